@@ -1,19 +1,68 @@
+// Define THREADS to let bitarray_op() split large arrays across threads (link
+// with -pthread).
+// Define RANK for bitarray_rank() and bitarray_select(), using a directory of
+// set bit counts which is built when first needed. bitarray_set() and
+// bitarray_clear() keep it up to date, other changes make it rebuild lazily
+// from the lowest changed bit. It adds about 5% to the array size.
+// Define CONCURRENT for cbitarray, which many threads can update without a
+// lock, e.g. as a map of free slots.
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#ifdef THREADS
+#include <pthread.h>
+#endif
 
 #define BTYPE unsigned int            // or unsigned char on AVR for example
 #define BWIDTH (sizeof(BTYPE)*8)
 #define BMASK(bit) ((BTYPE)1<<((bit) & BWIDTH-1))
+#define BWORDS(bits) (((bits) + (BWIDTH-1)) / BWIDTH)
+#define BLOW(word) __builtin_ctzll(word)        // lowest set bit of non-zero word
+#define BHIGH(word) (63 - __builtin_clzll(word)) // highest set bit of non-zero word
+
+#ifdef RANK
+#define SUPER 4096                    // bits per superblock
+#define BLOCK 512                     // bits per block
+#define DIRTY(b, bit) do { if ((bit) / SUPER < (b)->clean) (b)->clean = (bit) / SUPER; } while (0)
+#define ADJUST(b, bit, delta) bitarray_adjust(b, bit, delta)
+#else
+#define DIRTY(b, bit)
+#define ADJUST(b, bit, delta)
+#endif
 
 typedef struct
 {
-    unsigned bits;          // number of represented bits
-    unsigned set;           // count of set bits
+    uint64_t bits;          // number of represented bits
+    uint64_t set;           // count of set bits
+#ifdef RANK
+    uint64_t *super;        // set bits before each superblock, or NULL
+    uint16_t *block;        // set bits before each block in its superblock
+    uint64_t clean;         // superblocks whose counts are valid
+#endif
     BTYPE array[];          // zero length array
 } bitarray;
 
+#ifdef RANK
+// Add delta to the clean counts of set bits before the blocks and superblocks
+// after numbered bit, i.e. one add per superblock instead of a rebuild.
+static void bitarray_adjust(bitarray *b, uint64_t bit, int delta)
+{
+    uint64_t s = bit / SUPER, supers = b->bits / SUPER + 1;
+
+    if (s >= b->clean) return;
+    for (uint64_t k = bit / BLOCK + 1; k < (s + 1) * (SUPER / BLOCK); k++) b->block[k] += delta;
+    // the count before the first dirty superblock is still used
+    for (s++; s <= b->clean && s < supers; s++) b->super[s] += delta;
+}
+#endif
+
 // return 1 if numbered bit is set, 0 if clear, -1 if bit number is invalid
-int bitarray_test(bitarray *b, unsigned bit)
+int bitarray_test(bitarray *b, uint64_t bit)
 {
     if (bit >= b->bits) return -1;
     return (b->array[bit/BWIDTH] & BMASK(bit)) ? 1 : 0;
@@ -21,26 +70,28 @@ int bitarray_test(bitarray *b, unsigned bit)
 
 // Set numbered bit and return 0, or -1 if bit number is invalid
 // Track the number of bits set
-int bitarray_set(bitarray *b, unsigned bit)
+int bitarray_set(bitarray *b, uint64_t bit)
 {
     if (bit >= b->bits) return -1;
     if (!bitarray_test(b, bit))
     {
         b->set++;
         b->array[bit/BWIDTH] |= BMASK(bit);
+        ADJUST(b, bit, 1);
     }
     return 0;
 }
 
 // Reset numbered bit and return 0, or -1 if bit number is invalid
 // Track the number of bits set
-int bitarray_clear(bitarray *b, unsigned bit)
+int bitarray_clear(bitarray *b, uint64_t bit)
 {
     if (bit >= b->bits) return -1;
     if (bitarray_test(b, bit))
     {
         b->set--;
         b->array[bit/BWIDTH] &= ~BMASK(bit);
+        ADJUST(b, bit, -1);
     }
     return 0;
 }
@@ -48,42 +99,526 @@ int bitarray_clear(bitarray *b, unsigned bit)
 // Clear the bitarray
 void bitarray_init(bitarray *b)
 {
-    memset(b->array, 0, (b->bits + (BWIDTH-1)) / 8); // size in bytes
+    memset(b->array, 0, BWORDS(b->bits) * sizeof(BTYPE));
     b->set = 0;
+    DIRTY(b, 0);
 }
 
-// Invert the bitarray
+// Invert the bitarray, unused bits in the last word stay clear
 void bitarray_invert(bitarray *b)
 {
-    for (int n = 0; n < (b->bits + (BWIDTH-1)) / BWIDTH; n++) b->array[n] ^= (BTYPE)-1;
+    uint64_t words = BWORDS(b->bits);
+    for (uint64_t n = 0; n < words; n++) b->array[n] ^= (BTYPE)-1;
+    if (b->bits % BWIDTH) b->array[words-1] &= ((BTYPE)1 << (b->bits % BWIDTH)) - 1;
     b->set = b->bits - b->set;
+    DIRTY(b, 0);
 }
 
 // Create new bit array and return pointer, or NULL if OOM.
-// Caller must free() it when done.
-bitarray *bitarray_create(unsigned bits)
+// Caller must bitarray_destroy() it when done.
+bitarray *bitarray_create(uint64_t bits)
 {
-    bitarray *b = malloc(sizeof(bitarray) + ((bits + (BWIDTH-1)) / 8)); // size in bytes
+    bitarray *b = malloc(sizeof(bitarray) + BWORDS(bits) * sizeof(BTYPE));
     if (b)
     {
         b->bits = bits;
+#ifdef RANK
+        b->super = NULL;
+        b->block = NULL;
+        b->clean = 0;
+#endif
         bitarray_init(b);
     }
     return b;
 }
 
+// Free bit array created by bitarray_create()
+void bitarray_destroy(bitarray *b)
+{
+#ifdef RANK
+    free(b->super);
+    free(b->block);
+#endif
+    free(b);
+}
+
+// Return mask of the bits in word w which are in the range [start, end)
+static inline BTYPE bitarray_mask(uint64_t w, uint64_t start, uint64_t end)
+{
+    BTYPE mask = (BTYPE)-1;
+    if (w == start / BWIDTH) mask &= (BTYPE)-1 << (start % BWIDTH);
+    if (w == (end - 1) / BWIDTH) mask &= (BTYPE)-1 >> (BWIDTH - 1 - (end - 1) % BWIDTH);
+    return mask;
+}
+
+// Set count bits from start and return 0, or -1 if the range is invalid
+// Track the number of bits set
+int bitarray_set_range(bitarray *b, uint64_t start, uint64_t count)
+{
+    uint64_t end = start + count;
+    if (end > b->bits || end < start) return -1;
+    if (!count) return 0;
+    DIRTY(b, start);
+    for (uint64_t w = start / BWIDTH; w <= (end - 1) / BWIDTH; w++)
+    {
+        BTYPE mask = bitarray_mask(w, start, end);
+        b->set += __builtin_popcountll((BTYPE)(mask & ~b->array[w]));
+        b->array[w] |= mask;
+    }
+    return 0;
+}
+
+// Clear count bits from start and return 0, or -1 if the range is invalid
+// Track the number of bits set
+int bitarray_clear_range(bitarray *b, uint64_t start, uint64_t count)
+{
+    uint64_t end = start + count;
+    if (end > b->bits || end < start) return -1;
+    if (!count) return 0;
+    DIRTY(b, start);
+    for (uint64_t w = start / BWIDTH; w <= (end - 1) / BWIDTH; w++)
+    {
+        BTYPE mask = bitarray_mask(w, start, end);
+        b->set -= __builtin_popcountll((BTYPE)(mask & b->array[w]));
+        b->array[w] &= ~mask;
+    }
+    return 0;
+}
+
+// Return the number of set bits in count bits from start, or -1 if the range
+// is invalid
+int64_t bitarray_count_range(bitarray *b, uint64_t start, uint64_t count)
+{
+    uint64_t end = start + count, set = 0;
+    if (end > b->bits || end < start) return -1;
+    if (!count) return 0;
+    for (uint64_t w = start / BWIDTH; w <= (end - 1) / BWIDTH; w++)
+        set += __builtin_popcountll((BTYPE)(bitarray_mask(w, start, end) & b->array[w]));
+    return set;
+}
+
+// Return index of the first non-zero word in array from index w, or words if
+// none. Zero words are skipped 32 or 16 bytes at a time with SIMD if
+// available, otherwise 8 bytes at a time.
+static uint64_t bitarray_skip(BTYPE *array, uint64_t w, uint64_t words)
+{
+#if defined(__AVX2__)
+    for (__m256i v; w + 32/sizeof(BTYPE) <= words; w += 32/sizeof(BTYPE))
+        if (v = _mm256_loadu_si256((__m256i *)(array + w)), !_mm256_testz_si256(v, v)) break;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; w + 16/sizeof(BTYPE) <= words; w += 16/sizeof(BTYPE))
+        if (vmaxvq_u8(vld1q_u8((uint8_t *)(array + w)))) break;
+#else
+    for (uint64_t v; w + 8/sizeof(BTYPE) <= words; w += 8/sizeof(BTYPE))
+        if (memcpy(&v, array + w, 8), v) break;
+#endif
+    while (w < words && !array[w]) w++;
+    return w;
+}
+
+// Return index of the last non-zero word in array before index w, or -1 if
+// none.
+static int64_t bitarray_skip_back(BTYPE *array, uint64_t w)
+{
+#if defined(__AVX2__)
+    for (__m256i v; w >= 32/sizeof(BTYPE); w -= 32/sizeof(BTYPE))
+        if (v = _mm256_loadu_si256((__m256i *)(array + w) - 1), !_mm256_testz_si256(v, v)) break;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; w >= 16/sizeof(BTYPE); w -= 16/sizeof(BTYPE))
+        if (vmaxvq_u8(vld1q_u8((uint8_t *)(array + w) - 16))) break;
+#else
+    for (uint64_t v; w >= 8/sizeof(BTYPE); w -= 8/sizeof(BTYPE))
+        if (memcpy(&v, array + w - 8/sizeof(BTYPE), 8), v) break;
+#endif
+    while (w && !array[w-1]) w--;
+    return (int64_t)w - 1;
+}
+
 // Given a bit number, return that number if the bit is set, otherwise return
 // the next highest set bit, or -1 if none.
-int bitarray_next(bitarray *b, unsigned bit)
+int64_t bitarray_next(bitarray *b, uint64_t bit)
 {
-    while (bit < b->bits && b->array[bit/BWIDTH] < BMASK(bit)) bit = (bit & ~(BWIDTH-1)) + BWIDTH;
-    while (bit < b->bits && !(b->array[bit/BWIDTH] & BMASK(bit))) bit++;
+    uint64_t words = BWORDS(b->bits), w = bit / BWIDTH;
+    BTYPE x;
+
+    if (bit >= b->bits) return -1;
+    x = b->array[w] & ((BTYPE)-1 << (bit & (BWIDTH-1))); // ignore lower bits
+    if (!x)
+    {
+        if ((w = bitarray_skip(b->array, w + 1, words)) >= words) return -1;
+        x = b->array[w];
+    }
+    bit = w * BWIDTH + BLOW(x);
     return (bit < b->bits) ? bit : -1;
 }
 
-#ifdef POC  // Compiled with 'CFLAGS=-POC make bitarray'
+// Given a bit number, return that number if the bit is set, otherwise return
+// the next lowest set bit, or -1 if none. Bit numbers past the end start from
+// the last bit.
+int64_t bitarray_prev(bitarray *b, uint64_t bit)
+{
+    int64_t w;
+    BTYPE x;
+
+    if (!b->bits) return -1;
+    if (bit >= b->bits) bit = b->bits - 1;
+    w = bit / BWIDTH;
+    x = b->array[w] & ((BTYPE)-1 >> (BWIDTH - 1 - (bit & (BWIDTH-1)))); // ignore higher bits
+    if (!x)
+    {
+        if ((w = bitarray_skip_back(b->array, w)) < 0) return -1;
+        x = b->array[w];
+    }
+    return w * BWIDTH + BHIGH(x);
+}
+
+// Call fn with each set bit number in ascending order, stop early if fn
+// returns non-zero. Return the number of bits visited.
+uint64_t bitarray_for_each(bitarray *b, int (*fn)(uint64_t bit, void *arg), void *arg)
+{
+    uint64_t words = BWORDS(b->bits), visited = 0;
+
+    for (uint64_t w = bitarray_skip(b->array, 0, words); w < words; w = bitarray_skip(b->array, w + 1, words))
+    {
+        for (BTYPE x = b->array[w]; x; x &= x - 1)
+        {
+            uint64_t bit = w * BWIDTH + BLOW(x);
+            if (bit >= b->bits) return visited;
+            visited++;
+            if (fn(bit, arg)) return visited;
+        }
+    }
+    return visited;
+}
+
+// Binary operations for bitarray_op()
+enum bitop {BIT_AND, BIT_OR, BIT_XOR, BIT_ANDNOT};
+
+static inline BTYPE bitarray_op1(BTYPE x, BTYPE y, enum bitop op)
+{
+    switch (op)
+    {
+        case BIT_AND: return x & y;
+        case BIT_OR: return x | y;
+        case BIT_XOR: return x ^ y;
+        default: return x & ~y;
+    }
+}
+
+#ifdef __AVX2__
+static inline __m256i bitarray_op256(__m256i x, __m256i y, enum bitop op)
+{
+    switch (op)
+    {
+        case BIT_AND: return _mm256_and_si256(x, y);
+        case BIT_OR: return _mm256_or_si256(x, y);
+        case BIT_XOR: return _mm256_xor_si256(x, y);
+        default: return _mm256_andnot_si256(y, x);
+    }
+}
+
+// Return the popcount of each byte of v, by looking up each nibble
+static inline __m256i bitarray_popcount256(__m256i v)
+{
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    return _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(v, low)),
+                           _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+}
+#endif
+
+// Set words [from, to) of d to a op b, and return the number of bits set in
+// them. With AVX2 each pass does 32 bytes, per byte popcounts are summed for
+// up to 31 passes before they could overflow and are then added to the total.
+static uint64_t bitarray_words(BTYPE *d, BTYPE *a, BTYPE *b, uint64_t from, uint64_t to, enum bitop op)
+{
+    uint64_t w = from, set = 0;
+#ifdef __AVX2__
+    const uint64_t step = 32 / sizeof(BTYPE);
+    while (w + step <= to)
+    {
+        __m256i sum = _mm256_setzero_si256();
+        for (int n = 0; n < 31 && w + step <= to; n++, w += step)
+        {
+            __m256i x = bitarray_op256(_mm256_loadu_si256((__m256i *)(a + w)), _mm256_loadu_si256((__m256i *)(b + w)), op);
+            _mm256_storeu_si256((__m256i *)(d + w), x);
+            sum = _mm256_add_epi8(sum, bitarray_popcount256(x));
+        }
+        sum = _mm256_sad_epu8(sum, _mm256_setzero_si256()); // four 64-bit sums
+        set += _mm256_extract_epi64(sum, 0) + _mm256_extract_epi64(sum, 1) + _mm256_extract_epi64(sum, 2) + _mm256_extract_epi64(sum, 3);
+    }
+#endif
+    for (; w < to; w++) set += __builtin_popcountll(d[w] = bitarray_op1(a[w], b[w], op));
+    return set;
+}
+
+#ifdef THREADS
+#define BITARRAY_SPLIT (1 << 20)      // minimum bytes per thread
+
+struct bitarray_job
+{
+    pthread_t thread;
+    BTYPE *d, *a, *b;
+    uint64_t from, to, set;
+    enum bitop op;
+};
+
+static void *bitarray_worker(void *arg)
+{
+    struct bitarray_job *j = arg;
+    j->set = bitarray_words(j->d, j->a, j->b, j->from, j->to, j->op);
+    return NULL;
+}
+#endif
+
+// Set d to a op b and recount its set bits, d can be a or b to operate in
+// place. Use up to the specified number of threads if compiled with THREADS
+// and the arrays are large enough. Return 0, or -1 if the arrays have
+// different sizes.
+int bitarray_op(bitarray *d, bitarray *a, bitarray *b, enum bitop op, int threads)
+{
+    uint64_t words = BWORDS(a->bits);
+
+    if (a->bits != b->bits || d->bits != a->bits) return -1;
+    DIRTY(d, 0);
+#ifdef THREADS
+    if (threads > words * sizeof(BTYPE) / BITARRAY_SPLIT) threads = words * sizeof(BTYPE) / BITARRAY_SPLIT;
+    if (threads > 1)
+    {
+        struct bitarray_job job[threads];
+        uint64_t chunk = (words / threads) & ~(uint64_t)(64 / sizeof(BTYPE) - 1); // cache line multiple
+        d->set = 0;
+        for (int t = 0; t < threads; t++)
+        {
+            job[t] = (struct bitarray_job){.d = d->array, .a = a->array, .b = b->array,
+                                           .from = t * chunk, .to = (t < threads - 1) ? (t + 1) * chunk : words, .op = op};
+            if (t && pthread_create(&job[t].thread, NULL, bitarray_worker, &job[t])) abort();
+        }
+        bitarray_worker(&job[0]);
+        for (int t = 0; t < threads; t++)
+        {
+            if (t) pthread_join(job[t].thread, NULL);
+            d->set += job[t].set;
+        }
+        return 0;
+    }
+#else
+    (void)threads;
+#endif
+    d->set = bitarray_words(d->array, a->array, b->array, 0, words, op);
+    return 0;
+}
+
+#ifdef RANK
+// Bring the rank directory up to date, return 0 or -1 if OOM
+static int bitarray_index(bitarray *b)
+{
+    uint64_t supers = b->bits / SUPER + 1, words = BWORDS(b->bits), total;
+
+    if (!b->super)
+    {
+        // one more than needed, so there's an entry for bit number b->bits
+        b->super = malloc(supers * sizeof(uint64_t));
+        b->block = malloc(supers * (SUPER / BLOCK) * sizeof(uint16_t));
+        if (!b->super || !b->block)
+        {
+            free(b->super);
+            free(b->block);
+            b->super = NULL;
+            b->block = NULL;
+            return -1;
+        }
+        b->clean = 0;
+    }
+    if (b->clean == supers) return 0;
+
+    total = b->clean ? b->super[b->clean] : 0;
+    for (uint64_t s = b->clean; s < supers; s++)
+    {
+        b->super[s] = total;
+        for (uint64_t k = s * (SUPER / BLOCK); k < (s + 1) * (SUPER / BLOCK); k++)
+        {
+            b->block[k] = total - b->super[s];
+            for (uint64_t w = k * (BLOCK / BWIDTH); w < (k + 1) * (BLOCK / BWIDTH) && w < words; w++)
+                total += __builtin_popcountll(b->array[w]);
+        }
+    }
+    b->clean = supers;
+    return 0;
+}
+
+// Return the number of set bits before numbered bit, or -1 if bit number is
+// invalid or OOM. The bit number can be b->bits, to count all bits.
+// This is O(1) once the directory is built. bitarray_set() and bitarray_clear()
+// update it with one add per superblock above the bit, about bits/4096. The
+// range functions, bitarray_invert() and bitarray_op() instead leave it to be
+// rebuilt from the lowest changed bit on the next rank or select, which is
+// O(bits) after a change near the start.
+int64_t bitarray_rank(bitarray *b, uint64_t bit)
+{
+    uint64_t rank, w;
+
+    if (bit > b->bits || bitarray_index(b)) return -1;
+    rank = b->super[bit / SUPER] + b->block[bit / BLOCK];
+    for (w = bit / BLOCK * (BLOCK / BWIDTH); w < bit / BWIDTH; w++) rank += __builtin_popcountll(b->array[w]);
+    if (bit % BWIDTH) rank += __builtin_popcountll(b->array[w] & (BMASK(bit) - 1));
+    return rank;
+}
+
+// Return the number of the set bit with the specified rank, i.e. there are
+// rank set bits before it, or -1 if none or OOM.
+int64_t bitarray_select(bitarray *b, uint64_t rank)
+{
+    uint64_t lo = 0, hi, k, w;
+    BTYPE x;
+
+    if (rank >= b->set || bitarray_index(b)) return -1;
+
+    // last superblock with no more than rank bits before it
+    hi = b->bits / SUPER + 1;
+    while (hi - lo > 1)
+    {
+        uint64_t mid = (lo + hi) / 2;
+        if (b->super[mid] <= rank) lo = mid; else hi = mid;
+    }
+    rank -= b->super[lo];
+
+    // then the last block, then the word
+    for (k = lo * (SUPER / BLOCK); k + 1 < (lo + 1) * (SUPER / BLOCK) && b->block[k + 1] <= rank; k++);
+    rank -= b->block[k];
+    for (w = k * (BLOCK / BWIDTH); rank >= (uint64_t)__builtin_popcountll(b->array[w]); w++) rank -= __builtin_popcountll(b->array[w]);
+
+    for (x = b->array[w]; rank; rank--) x &= x - 1; // drop lower bits
+    return w * BWIDTH + BLOW(x);
+}
+#endif
+
+#ifdef CONCURRENT
+// Bits are changed with atomic fetch-or and fetch-and on their word, and
+// cbitarray_claim() finds a clear bit and sets it the same way, retrying if
+// another thread got there first. The count of set bits is split into
+// shards, each on its own cache line, and threads are assigned to shards
+// round robin. Each shard also remembers where its threads last claimed a
+// bit, so threads look in different parts of the array.
+#define SHARDS 16
+
+struct shard
+{
+    int64_t set;                      // bits set less bits cleared by this shard's threads
+    uint64_t hint;                    // word to start the next claim
+} __attribute__((aligned(64)));
+
+typedef struct
+{
+    uint64_t bits;                    // number of represented bits
+    struct shard shard[SHARDS];
+    BTYPE array[];
+} cbitarray;
+
+// Return this thread's shard
+static struct shard *cbitarray_shard(cbitarray *b)
+{
+    static int next;
+    static __thread int shard = -1;
+    if (shard < 0) shard = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % SHARDS;
+    return &b->shard[shard];
+}
+
+// return 1 if numbered bit is set, 0 if clear, -1 if bit number is invalid
+int cbitarray_test(cbitarray *b, uint64_t bit)
+{
+    if (bit >= b->bits) return -1;
+    return (__atomic_load_n(&b->array[bit/BWIDTH], __ATOMIC_ACQUIRE) & BMASK(bit)) ? 1 : 0;
+}
+
+// Set numbered bit and return its previous state 0 or 1, or -1 if bit number
+// is invalid
+int cbitarray_set(cbitarray *b, uint64_t bit)
+{
+    if (bit >= b->bits) return -1;
+    if (__atomic_fetch_or(&b->array[bit/BWIDTH], BMASK(bit), __ATOMIC_ACQ_REL) & BMASK(bit)) return 1;
+    __atomic_fetch_add(&cbitarray_shard(b)->set, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Reset numbered bit and return its previous state 0 or 1, or -1 if bit
+// number is invalid
+int cbitarray_clear(cbitarray *b, uint64_t bit)
+{
+    if (bit >= b->bits) return -1;
+    if (!(__atomic_fetch_and(&b->array[bit/BWIDTH], (BTYPE)~BMASK(bit), __ATOMIC_ACQ_REL) & BMASK(bit))) return 0;
+    __atomic_fetch_sub(&cbitarray_shard(b)->set, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Find a clear bit, set it and return its number, or -1 if all bits are set.
+// The search starts where this thread's shard last claimed a bit and wraps
+// around the end, the starting word is checked again at the end in case a
+// bit was cleared behind the search.
+int64_t cbitarray_claim(cbitarray *b)
+{
+    struct shard *s = cbitarray_shard(b);
+    uint64_t words = BWORDS(b->bits), w = __atomic_load_n(&s->hint, __ATOMIC_RELAXED);
+
+    if (!words) return -1;
+    for (uint64_t n = 0; n <= words; n++, w = (w + 1 < words) ? w + 1 : 0)
+    {
+        BTYPE valid = (w == words - 1 && b->bits % BWIDTH) ? BMASK(b->bits) - 1 : (BTYPE)-1;
+        BTYPE x = __atomic_load_n(&b->array[w], __ATOMIC_RELAXED);
+        while ((BTYPE)(~x & valid))
+        {
+            BTYPE mask = (BTYPE)1 << BLOW((BTYPE)(~x & valid));
+            x = __atomic_fetch_or(&b->array[w], mask, __ATOMIC_ACQ_REL);
+            if (!(x & mask))
+            {
+                __atomic_store_n(&s->hint, w, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&s->set, 1, __ATOMIC_RELAXED);
+                return w * BWIDTH + BLOW(mask);
+            }
+        }
+    }
+    return -1;
+}
+
+// Return the number of set bits, only exact when no other thread is changing
+// the array
+uint64_t cbitarray_count(cbitarray *b)
+{
+    int64_t set = 0;
+    for (int s = 0; s < SHARDS; s++) set += __atomic_load_n(&b->shard[s].set, __ATOMIC_RELAXED);
+    return set;
+}
+
+// Create new concurrent bit array with all bits clear and return pointer, or
+// NULL if OOM. Caller must free() it when done.
+cbitarray *cbitarray_create(uint64_t bits)
+{
+    size_t size = (sizeof(cbitarray) + BWORDS(bits) * sizeof(BTYPE) + 63) & ~(size_t)63;
+    cbitarray *b = aligned_alloc(64, size);
+    if (b)
+    {
+        memset(b, 0, size);
+        b->bits = bits;
+        for (int s = 0; s < SHARDS; s++) b->shard[s].hint = BWORDS(bits) * s / SHARDS;
+    }
+    return b;
+}
+#endif
+
+// Define NOMAIN to #include this file into another program.
+#if defined(POC) && !defined(NOMAIN)  // Compiled with 'CFLAGS=-DPOC make bitarray'
 #include <stdio.h>
 #include <assert.h>
+
+// bitarray_for_each callback, check bit against next expected value
+static int check(uint64_t bit, void *expect)
+{
+    static int n = 0;
+    assert(bit == ((unsigned *)expect)[n++]);
+    return 0;
+}
+
 int main(void)
 {
     bitarray *b = bitarray_create(253);
@@ -112,12 +647,363 @@ int main(void)
     assert(bitarray_next(b, 99) == 99);
     assert(bitarray_next(b, 100) == 200);
     assert(bitarray_next(b, 201) == -1);
+    assert(bitarray_prev(b, 201) == 200);
+    assert(bitarray_prev(b, 200) == 200);
+    assert(bitarray_prev(b, 199) == 99);
+    assert(bitarray_prev(b, 97) == -1);
+    assert(bitarray_prev(b, 1000) == 200);
     assert(!bitarray_set(b, 252));
     assert(bitarray_set(b, 253));
     assert(b->set == 4);
+    assert(bitarray_for_each(b, check, (unsigned []){98, 99, 200, 252}) == 4);
     bitarray_invert(b);
     assert(b->set == 249);
     assert(bitarray_test(b, 99) == 0);
+    assert(bitarray_count_range(b, 0, 253) == 249);
+    assert(bitarray_count_range(b, 90, 20) == 18);
+    assert(!bitarray_clear_range(b, 10, 230));
+    assert(b->set == 22);
+    assert(bitarray_next(b, 10) == 240);
+    assert(bitarray_prev(b, 239) == 9);
+    assert(!bitarray_set_range(b, 5, 50));
+    assert(b->set == 67);
+    assert(bitarray_count_range(b, 0, 64) == 55);
+    assert(bitarray_set_range(b, 200, 54));   // should fail
+    assert(!bitarray_set_range(b, 200, 0));
+    assert(bitarray_count_range(b, 200, 0) == 0);
+
+    bitarray *c = bitarray_create(253), *d = bitarray_create(253), *e = bitarray_create(254);
+    bitarray_set_range(c, 50, 100);
+    assert(!bitarray_op(d, b, c, BIT_AND, 1));
+    assert(d->set == 5 && bitarray_next(d, 0) == 50 && bitarray_prev(d, 252) == 54);
+    assert(!bitarray_op(d, b, c, BIT_OR, 1));
+    assert(d->set == 67 + 100 - 5);
+    assert(!bitarray_op(d, b, c, BIT_XOR, 1));
+    assert(d->set == 67 + 100 - 10 && !bitarray_test(d, 52));
+    assert(!bitarray_op(b, b, c, BIT_ANDNOT, 1)); // in place
+    assert(b->set == 62 && bitarray_next(b, 10) == 10 && bitarray_next(b, 50) == 240);
+    assert(bitarray_op(d, b, e, BIT_AND, 1)); // should fail
+#ifdef RANK
+    assert(bitarray_rank(b, 0) == 0);
+    assert(bitarray_rank(b, 10) == 10);
+    assert(bitarray_rank(b, 100) == 50);
+    assert(bitarray_rank(b, 253) == 62);
+    assert(bitarray_rank(b, 254) == -1);
+    assert(bitarray_select(b, 0) == 0);
+    assert(bitarray_select(b, 49) == 49);
+    assert(bitarray_select(b, 50) == 240);
+    assert(bitarray_select(b, 61) == 251);
+    assert(bitarray_select(b, 62) == -1);
+    assert(!bitarray_clear(b, 20));
+    assert(bitarray_rank(b, 253) == 61 && bitarray_select(b, 20) == 21);
+    {
+        // single bit changes update the directory, ranges mark it stale
+        bitarray *r = bitarray_create(3 * SUPER + 77);
+        for (uint64_t i = 0; i < r->bits; i += 3) bitarray_set(r, i);
+        for (int i = 0; i < 2000; i++)
+        {
+            uint64_t bit = (i * 7919ULL) % r->bits, at = (i * 104729ULL) % (r->bits + 1);
+            if (i % 3) bitarray_set(r, bit); else bitarray_clear(r, bit);
+            if (i % 100 == 50)
+            {
+                bitarray_clear_range(r, 2 * SUPER + bit % SUPER, 100);
+                bitarray_set(r, bit % SUPER); // before the stale part
+            }
+            assert(bitarray_rank(r, at) == bitarray_count_range(r, 0, at));
+            if (at < r->set) assert(bitarray_rank(r, bitarray_select(r, at)) == (int64_t)at);
+        }
+        bitarray_destroy(r);
+    }
+#endif
+#ifdef CONCURRENT
+    cbitarray *cb = cbitarray_create(100);
+    assert(!cbitarray_set(cb, 50));
+    assert(cbitarray_set(cb, 50) == 1);
+    for (int i = 0; i < 99; i++)
+    {
+        int64_t bit = cbitarray_claim(cb);
+        assert(bit >= 0 && bit < 100 && bit != 50);
+    }
+    assert(cbitarray_claim(cb) == -1);
+    assert(cbitarray_count(cb) == 100);
+    assert(cbitarray_clear(cb, 7) == 1);
+    assert(!cbitarray_clear(cb, 7));
+    assert(cbitarray_claim(cb) == 7);
+    assert(cbitarray_test(cb, 7) == 1 && cbitarray_test(cb, 100) == -1);
+    assert(cbitarray_count(cb) == 100);
+    free(cb);
+#endif
+    bitarray_destroy(b);
+    bitarray_destroy(c);
+    bitarray_destroy(d);
+    bitarray_destroy(e);
     printf("Seems to be working...\n");
 }
 #endif
+
+// To build the benchmark: CFLAGS="-O3 -march=native -DBENCH" make -B bitarray
+// Then run "./bitarray [bits]", default 2^27. For each density from 0.001% to
+// 50% it times a full scan with the original bitarray_next, the word scanning
+// bitarray_next, and bitarray_for_each, in ns per set bit. Then it times
+// setting, counting and clearing all bits one at a time and as a range.
+// Finally it times each bitarray_op() against a plain word loop followed by
+// bitarray_count_range(), add -DTHREADS and LDLIBS=-pthread to also time
+// bitarray_op() with 2 to 8 threads. Add -DRANK to time bitarray_rank() and
+// bitarray_select() against scanning.
+//
+// Or add -DCONCURRENT and LDLIBS=-pthread and run "./bitarray threads [max]"
+// to compare slot allocation with 1 to max threads (default 64) using a plain
+// bitarray behind a mutex and using cbitarray.
+#if defined(BENCH) && !defined(NOMAIN)
+#include <stdio.h>
+#include <time.h>
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64
+static unsigned long long rnd(void)
+{
+    static unsigned long long x = 88172645463325252ULL;
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    return x;
+}
+
+// The original bitarray_next, which tests one bit at a time
+static int64_t old_next(bitarray *b, uint64_t bit)
+{
+    while (bit < b->bits && b->array[bit/BWIDTH] < BMASK(bit)) bit = (bit & ~(BWIDTH-1)) + BWIDTH;
+    while (bit < b->bits && !(b->array[bit/BWIDTH] & BMASK(bit))) bit++;
+    return (bit < b->bits) ? bit : -1;
+}
+
+static int visit(uint64_t bit, void *sum)
+{
+    *(unsigned long long *)sum += bit;
+    return 0;
+}
+
+#ifdef CONCURRENT
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define SLOTS (1 << 20)               // slots in the map
+#define HOLD 64                       // slots held by each thread
+static bitarray *map;
+static cbitarray *cmap;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t hint;
+static bool stop;
+
+// Claim a clear bit in map, as cbitarray_claim() but with the lock held
+static int64_t claim(void)
+{
+    uint64_t words = BWORDS(map->bits);
+    for (uint64_t n = 0; n < words; n++, hint = (hint + 1) % words)
+        if (map->array[hint] != (BTYPE)-1)
+        {
+            int64_t bit = hint * BWIDTH + BLOW((BTYPE)~map->array[hint]);
+            bitarray_set(map, bit);
+            return bit;
+        }
+    return -1;
+}
+
+// Repeatedly claim a slot and release the oldest held slot, return the number
+// of claims
+static void *worker(void *arg)
+{
+    int64_t held[HOLD];
+    uint64_t claims = 0;
+    bool locked = arg;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    {
+        int64_t *slot = &held[claims % HOLD];
+        if (locked)
+        {
+            pthread_mutex_lock(&lock);
+            if (claims >= HOLD) bitarray_clear(map, *slot);
+            *slot = claim();
+            pthread_mutex_unlock(&lock);
+        }
+        else
+        {
+            if (claims >= HOLD) cbitarray_clear(cmap, *slot);
+            *slot = cbitarray_claim(cmap);
+        }
+        if (*slot < 0) abort();
+        claims++;
+    }
+    return (void *)(uintptr_t)claims;
+}
+
+static void threads(int max)
+{
+    printf("%7s %16s %16s\n", "threads", "mutex claims/s", "atomic claims/s");
+    for (int count = 1; count <= max; count *= 2)
+    {
+        pthread_t tid[count];
+        double rate[2];
+
+        for (int mode = 0; mode < 2; mode++)
+        {
+            uint64_t claims = 0, held = 0;
+            void *ret;
+            double start = now();
+
+            if (!(map = bitarray_create(SLOTS)) || !(cmap = cbitarray_create(SLOTS))) abort();
+            hint = 0;
+            stop = false;
+            for (int i = 0; i < count; i++) pthread_create(&tid[i], NULL, worker, (void *)(uintptr_t)!mode);
+            sleep(1);
+            __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+            for (int i = 0; i < count; i++)
+            {
+                pthread_join(tid[i], &ret);
+                claims += (uintptr_t)ret;
+                held += ((uintptr_t)ret < HOLD) ? (uintptr_t)ret : HOLD;
+            }
+            rate[mode] = claims / (now() - start);
+
+            // every slot still held is set exactly once
+            if ((mode ? cbitarray_count(cmap) : map->set) != held) abort();
+            bitarray_destroy(map);
+            free(cmap);
+        }
+        printf("%7d %16.0f %16.0f\n", count, rate[0], rate[1]);
+    }
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+#ifdef CONCURRENT
+    if (argc > 1 && !strcmp(argv[1], "threads"))
+    {
+        threads((argc > 2) ? atoi(argv[2]) : 64);
+        return 0;
+    }
+#endif
+    uint64_t bits = (argc > 1) ? strtoull(argv[1], NULL, 0) : 1ULL << 27;
+    double density[] = {0.00001, 0.0001, 0.001, 0.01, 0.1, 0.5};
+    bitarray *b = bitarray_create(bits);
+    if (!b) abort();
+
+    printf("%llu bits, ns per set bit\n", (unsigned long long)bits);
+    printf("%8s %10s %8s %8s %8s\n", "density", "set", "old", "next", "for_each");
+    for (int d = 0; d < sizeof(density) / sizeof(density[0]); d++)
+    {
+        unsigned long long sums[3] = {0};
+        double start, t[3];
+
+        bitarray_init(b);
+        while (b->set < bits * density[d]) bitarray_set(b, rnd() % bits);
+
+        start = now();
+        for (int64_t bit = old_next(b, 0); bit >= 0; bit = old_next(b, bit + 1)) sums[0] += bit;
+        t[0] = now();
+        for (int64_t bit = bitarray_next(b, 0); bit >= 0; bit = bitarray_next(b, bit + 1)) sums[1] += bit;
+        t[1] = now();
+        bitarray_for_each(b, visit, &sums[2]);
+        t[2] = now();
+        if (sums[0] != sums[1] || sums[0] != sums[2]) abort();
+
+        printf("%7.3f%% %10llu %8.2f %8.2f %8.2f\n", density[d] * 100, (unsigned long long)b->set,
+               (t[0] - start) * 1e9 / b->set, (t[1] - t[0]) * 1e9 / b->set, (t[2] - t[1]) * 1e9 / b->set);
+    }
+
+    double start = now(), t[6];
+    bitarray_init(b);
+    for (uint64_t bit = 0; bit < bits; bit++) bitarray_set(b, bit);
+    t[0] = now();
+    uint64_t set = 0;
+    for (uint64_t bit = 0; bit < bits; bit++) set += bitarray_test(b, bit);
+    t[1] = now();
+    for (uint64_t bit = 0; bit < bits; bit++) bitarray_clear(b, bit);
+    t[2] = now();
+    bitarray_set_range(b, 1, bits - 1);
+    t[3] = now();
+    if (set != bits || bitarray_count_range(b, 0, bits) != bits - 1) abort();
+    t[4] = now();
+    bitarray_clear_range(b, 1, bits - 1);
+    t[5] = now();
+    if (b->set) abort();
+
+    printf("\n%8s %8s %8s %8s ms\n", "", "set", "count", "clear");
+    printf("%8s %8.2f %8.2f %8.2f\n", "per bit", (t[0] - start) * 1e3, (t[1] - t[0]) * 1e3, (t[2] - t[1]) * 1e3);
+    printf("%8s %8.2f %8.2f %8.2f\n", "range", (t[3] - t[2]) * 1e3, (t[4] - t[3]) * 1e3, (t[5] - t[4]) * 1e3);
+
+    bitarray *a = bitarray_create(bits), *c = bitarray_create(bits);
+    if (!a || !c) abort();
+    for (uint64_t w = 0; w < BWORDS(bits); w++) a->array[w] = rnd(), b->array[w] = rnd();
+    if (bits % BWIDTH) a->array[BWORDS(bits) - 1] &= ((BTYPE)1 << (bits % BWIDTH)) - 1;
+    if (bits % BWIDTH) b->array[BWORDS(bits) - 1] &= ((BTYPE)1 << (bits % BWIDTH)) - 1;
+
+    printf("\n%8s %8s %8s", "", "loop", "op");
+#ifdef THREADS
+    for (int threads = 2; threads <= 8; threads *= 2) printf(" %7dt", threads);
+#endif
+    printf(" ms\n");
+    for (enum bitop op = BIT_AND; op <= BIT_ANDNOT; op++)
+    {
+        printf("%8s", (char *[]){"and", "or", "xor", "andnot"}[op]);
+        start = now();
+        for (uint64_t w = 0; w < BWORDS(bits); w++) c->array[w] = bitarray_op1(a->array[w], b->array[w], op);
+        uint64_t set = bitarray_count_range(c, 0, bits);
+        printf(" %8.2f", (now() - start) * 1e3);
+        start = now();
+        bitarray_op(c, a, b, op, 1);
+        printf(" %8.2f", (now() - start) * 1e3);
+        if (c->set != set) abort();
+#ifdef THREADS
+        for (int threads = 2; threads <= 8; threads *= 2)
+        {
+            start = now();
+            bitarray_op(c, a, b, op, threads);
+            printf(" %8.2f", (now() - start) * 1e3);
+            if (c->set != set) abort();
+        }
+#endif
+        printf("\n");
+    }
+
+#ifdef RANK
+    // c holds the last result, about 50% set
+    uint64_t sum = 0;
+    start = now();
+    bitarray_rank(c, 0);
+    t[0] = now();
+    for (int i = 0; i < 1000000; i++) sum += bitarray_rank(c, rnd() % bits);
+    t[1] = now();
+    for (int i = 0; i < 100; i++) sum -= bitarray_count_range(c, 0, rnd() % bits);
+    t[2] = now();
+    for (int i = 0; i < 1000000; i++) sum += bitarray_select(c, rnd() % c->set);
+    t[3] = now();
+    for (int i = 0; i < 1000; i++)
+    {
+        if (i & 1) bitarray_clear(c, i); else bitarray_set(c, i);
+        sum += bitarray_rank(c, bits);
+    }
+    t[4] = now();
+    bitarray_clear_range(c, 0, 1);
+    bitarray_rank(c, 0);
+    t[5] = now();
+    printf("\nrank directory %.1f%% of array, built in %.2f ms\n",
+           100.0 * (bits / SUPER + 1) * (sizeof(uint64_t) + SUPER / BLOCK * sizeof(uint16_t)) / (BWORDS(bits) * sizeof(BTYPE)),
+           (t[0] - start) * 1e3);
+    printf("rank %.1f ns, count_range from 0 %.1f ns, select %.1f ns (%llu)\n",
+           (t[1] - t[0]) * 1e3, (t[2] - t[1]) * 1e9 / 100, (t[3] - t[2]) * 1e3, (unsigned long long)sum);
+    printf("set or clear low bit then rank %.1f ns, rebuild after a range %.2f ms\n", (t[4] - t[3]) * 1e6, (t[5] - t[4]) * 1e3);
+#endif
+    bitarray_destroy(a);
+    bitarray_destroy(b);
+    bitarray_destroy(c);
+    return 0;
+}
+#endif
@@ -0,0 +1,485 @@
+// B+tree with the same semantics as bst.c: long long keys map to malloced (or
+// NULL) values which the tree owns, and an optional per-key counter. Keys are
+// packed ORDER to a cache-line aligned node and each node is searched with a
+// fixed length branchless loop that the compiler can vectorize, so a lookup
+// costs a few cache lines per level instead of one cache miss per key.
+//
+// Insert splits full nodes and delete refills minimal nodes on the way down,
+// so neither needs to walk back up the tree.
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+
+#define ORDER 16                // keys per node, 16 long longs is two cache lines
+#define LEAFMIN (ORDER/2)       // minimum keys in a leaf other than the root
+#define INNERMIN (ORDER/2-1)    // minimum keys in an inner node other than the root
+
+struct bpentry
+{
+    void *value;
+    int counter;
+};
+
+struct bpnode
+{
+    long long key[ORDER];       // unused keys are LLONG_MAX
+    int count;                  // number of keys in use
+    bool leaf;
+    union
+    {
+        // inner node, keys in child[i] are >= key[i-1] and < key[i]
+        struct bpnode *child[ORDER+1];
+        // leaf node, with link to the next leaf in key order
+        struct
+        {
+            struct bpentry entry[ORDER];
+            struct bpnode *next;
+        };
+    };
+};
+
+struct bptree
+{
+    struct bpnode *root;        // NULL if tree is empty
+};
+
+// Return a new empty node
+static struct bpnode *bp_alloc(bool leaf)
+{
+    struct bpnode *n = aligned_alloc(64, (sizeof(struct bpnode) + 63) & ~63);
+    if (!n) abort();
+    for (int i = 0; i < ORDER; i++) n->key[i] = LLONG_MAX;
+    n->count = 0;
+    n->leaf = leaf;
+    if (leaf) n->next = NULL;
+    return n;
+}
+
+// Reset unused keys after node shrinks
+static void bp_pad(struct bpnode *n)
+{
+    for (int i = n->count; i < ORDER; i++) n->key[i] = LLONG_MAX;
+}
+
+// Return number of keys in node less than key
+static inline int bp_below(struct bpnode *n, long long key)
+{
+    int r = 0;
+    for (int i = 0; i < ORDER; i++) r += n->key[i] < key;
+    return r;
+}
+
+// Return index of inner node's child that would contain key
+static inline int bp_child(struct bpnode *n, long long key)
+{
+    int r = 0;
+    for (int i = 0; i < ORDER; i++) r += n->key[i] <= key;
+    return (r > n->count) ? n->count : r; // in case key is LLONG_MAX
+}
+
+// Split full child i of non-full inner node p
+static void bp_split(struct bpnode *p, int i)
+{
+    struct bpnode *l = p->child[i], *r = bp_alloc(l->leaf);
+    long long sep;
+
+    if (l->leaf)
+    {
+        // upper half moves to the new leaf, its first key is copied up
+        r->count = l->count - LEAFMIN;
+        memcpy(r->key, l->key + LEAFMIN, r->count * sizeof(long long));
+        memcpy(r->entry, l->entry + LEAFMIN, r->count * sizeof(struct bpentry));
+        r->next = l->next;
+        l->next = r;
+        l->count = LEAFMIN;
+        sep = r->key[0];
+    }
+    else
+    {
+        // middle key moves up, upper half moves to the new node
+        int m = l->count / 2;
+        sep = l->key[m];
+        r->count = l->count - m - 1;
+        memcpy(r->key, l->key + m + 1, r->count * sizeof(long long));
+        memcpy(r->child, l->child + m + 1, (r->count + 1) * sizeof(struct bpnode *));
+        l->count = m;
+    }
+    bp_pad(l);
+
+    memmove(p->key + i + 1, p->key + i, (p->count - i) * sizeof(long long));
+    memmove(p->child + i + 2, p->child + i + 1, (p->count - i) * sizeof(struct bpnode *));
+    p->key[i] = sep;
+    p->child[i+1] = r;
+    p->count++;
+}
+
+// Move the last key of child i-1 to the front of child i
+static void bp_borrow_left(struct bpnode *p, int i)
+{
+    struct bpnode *l = p->child[i-1], *c = p->child[i];
+
+    memmove(c->key + 1, c->key, c->count * sizeof(long long));
+    if (c->leaf)
+    {
+        memmove(c->entry + 1, c->entry, c->count * sizeof(struct bpentry));
+        c->key[0] = l->key[l->count-1];
+        c->entry[0] = l->entry[l->count-1];
+        p->key[i-1] = c->key[0];
+    }
+    else
+    {
+        // rotate through the parent
+        memmove(c->child + 1, c->child, (c->count + 1) * sizeof(struct bpnode *));
+        c->key[0] = p->key[i-1];
+        c->child[0] = l->child[l->count];
+        p->key[i-1] = l->key[l->count-1];
+    }
+    c->count++;
+    l->count--;
+    bp_pad(l);
+}
+
+// Move the first key of child i+1 to the end of child i
+static void bp_borrow_right(struct bpnode *p, int i)
+{
+    struct bpnode *c = p->child[i], *r = p->child[i+1];
+
+    if (c->leaf)
+    {
+        c->key[c->count] = r->key[0];
+        c->entry[c->count] = r->entry[0];
+        memmove(r->entry, r->entry + 1, (r->count - 1) * sizeof(struct bpentry));
+        memmove(r->key, r->key + 1, (r->count - 1) * sizeof(long long));
+        p->key[i] = r->key[0];
+    }
+    else
+    {
+        // rotate through the parent
+        c->key[c->count] = p->key[i];
+        c->child[c->count+1] = r->child[0];
+        p->key[i] = r->key[0];
+        memmove(r->key, r->key + 1, (r->count - 1) * sizeof(long long));
+        memmove(r->child, r->child + 1, r->count * sizeof(struct bpnode *));
+    }
+    c->count++;
+    r->count--;
+    bp_pad(r);
+}
+
+// Merge child i+1 into child i and remove it from the parent
+static void bp_merge(struct bpnode *p, int i)
+{
+    struct bpnode *l = p->child[i], *r = p->child[i+1];
+
+    if (l->leaf)
+    {
+        memcpy(l->key + l->count, r->key, r->count * sizeof(long long));
+        memcpy(l->entry + l->count, r->entry, r->count * sizeof(struct bpentry));
+        l->next = r->next;
+        l->count += r->count;
+    }
+    else
+    {
+        // separator comes down from the parent
+        l->key[l->count] = p->key[i];
+        memcpy(l->key + l->count + 1, r->key, r->count * sizeof(long long));
+        memcpy(l->child + l->count + 1, r->child, (r->count + 1) * sizeof(struct bpnode *));
+        l->count += r->count + 1;
+    }
+    free(r);
+
+    memmove(p->key + i, p->key + i + 1, (p->count - i - 1) * sizeof(long long));
+    memmove(p->child + i + 1, p->child + i + 2, (p->count - i - 1) * sizeof(struct bpnode *));
+    p->count--;
+    bp_pad(p);
+}
+
+// Make sure child i of p has more than the minimum keys, by borrowing from or
+// merging with a sibling. Return the index of the child that now covers the
+// same keys.
+static int bp_refill(struct bpnode *p, int i)
+{
+    int min = p->child[i]->leaf ? LEAFMIN : INNERMIN;
+
+    if (p->child[i]->count > min) return i;
+    if (i > 0 && p->child[i-1]->count > min) bp_borrow_left(p, i);
+    else if (i < p->count && p->child[i+1]->count > min) bp_borrow_right(p, i);
+    else if (i > 0) bp_merge(p, --i);
+    else bp_merge(p, i);
+    return i;
+}
+
+// Insert key and value into tree.
+// If key already exists, just replace the value.
+// Note *value must either be NULL or malloced.
+// If counting then increment counter if key exists.
+void bp_insert(struct bptree *t, long long key, void *value, bool counting)
+{
+    struct bpnode *n = t->root;
+    int i;
+
+    if (!n) n = t->root = bp_alloc(true);
+    if (n->count == ORDER)
+    {
+        // root is full, the tree grows up
+        t->root = bp_alloc(false);
+        t->root->child[0] = n;
+        bp_split(t->root, 0);
+        n = t->root;
+    }
+
+    while (!n->leaf)
+    {
+        i = bp_child(n, key);
+        if (n->child[i]->count == ORDER)
+        {
+            bp_split(n, i);
+            if (key >= n->key[i]) i++;
+        }
+        n = n->child[i];
+    }
+
+    i = bp_below(n, key);
+    if (i < n->count && n->key[i] == key)
+    {
+        if (n->entry[i].value) free(n->entry[i].value);
+        n->entry[i].value = value;
+        if (counting) n->entry[i].counter++;
+        return;
+    }
+
+    memmove(n->key + i + 1, n->key + i, (n->count - i) * sizeof(long long));
+    memmove(n->entry + i + 1, n->entry + i, (n->count - i) * sizeof(struct bpentry));
+    n->key[i] = key;
+    n->entry[i].value = value;
+    n->entry[i].counter = 1;
+    n->count++;
+}
+
+// Delete key from tree if it exists. If counting, only delete when the
+// counter decrements to 0.
+void bp_delete(struct bptree *t, long long key, bool counting)
+{
+    struct bpnode *n = t->root;
+    int i;
+
+    if (!n) return;
+
+    while (!n->leaf)
+    {
+        struct bpnode *c = n->child[i = bp_refill(n, bp_child(n, key))];
+        if (!n->count)
+        {
+            // root merged its last two children, the tree shrinks
+            t->root = c;
+            free(n);
+        }
+        n = c;
+    }
+
+    i = bp_below(n, key);
+    if (i == n->count || n->key[i] != key) return;
+    if (counting && --n->entry[i].counter) return; // maybe just decrement the count to 0
+
+    if (n->entry[i].value) free(n->entry[i].value);
+    memmove(n->key + i, n->key + i + 1, (n->count - i - 1) * sizeof(long long));
+    memmove(n->entry + i, n->entry + i + 1, (n->count - i - 1) * sizeof(struct bpentry));
+    n->count--;
+    bp_pad(n);
+
+    if (!n->count)
+    {
+        // only the root leaf can become empty
+        free(n);
+        t->root = NULL;
+    }
+}
+
+// Return entry containing specified key, or NULL
+struct bpentry *bp_search(struct bptree *t, long long key)
+{
+    struct bpnode *n = t->root;
+    int i;
+
+    if (!n) return NULL;
+    while (!n->leaf) n = n->child[bp_child(n, key)];
+    i = bp_below(n, key);
+    return (i < n->count && n->key[i] == key) ? &n->entry[i] : NULL;
+}
+
+// Free node and its descendents, and their values
+static void bp_free(struct bpnode *n)
+{
+    if (n->leaf)
+        for (int i = 0; i < n->count; i++) { if (n->entry[i].value) free(n->entry[i].value); }
+    else
+        for (int i = 0; i <= n->count; i++) bp_free(n->child[i]);
+    free(n);
+}
+
+// Free the entire tree and leave it empty
+void bp_destroy(struct bptree *t)
+{
+    if (t->root) bp_free(t->root);
+    t->root = NULL;
+}
+
+// To build the proof-of-concept: CFLAGS=-DPOC make -B bptree
+// It performs random operations and checks the tree against a flat array.
+// Define NOMAIN to #include this file into another program.
+#if defined(POC) && !defined(NOMAIN)
+#include <stdio.h>
+#include <assert.h>
+
+#define KEYS 5000
+int counter[KEYS];              // expected counter for each key, 0 if absent
+
+// Check node structure and key bounds, return the node's depth
+static int check(struct bpnode *n, long long lo, long long hi, bool root, int *count)
+{
+    int depth = 0;
+    assert(n->count <= ORDER);
+    if (!root) assert(n->count >= (n->leaf ? LEAFMIN : INNERMIN));
+    for (int i = 0; i < ORDER; i++)
+    {
+        if (i >= n->count) assert(n->key[i] == LLONG_MAX);
+        else
+        {
+            assert(n->key[i] >= lo && n->key[i] < hi);
+            if (i) assert(n->key[i] > n->key[i-1]);
+        }
+    }
+    if (n->leaf)
+    {
+        for (int i = 0; i < n->count; i++) assert(n->entry[i].counter == counter[n->key[i]]);
+        *count += n->count;
+        return 1;
+    }
+    for (int i = 0; i <= n->count; i++)
+    {
+        int d = check(n->child[i], i ? n->key[i-1] : lo, (i < n->count) ? n->key[i] : hi, false, count);
+        if (i) assert(d == depth);
+        depth = d;
+    }
+    return depth + 1;
+}
+
+int main(void)
+{
+    struct bptree tree = {0};
+    int present = 0;
+
+    srand(1);
+    for (int i = 0; i < 1000000; i++)
+    {
+        int key = rand() % KEYS;
+        bool counting = rand() & 1;
+        if (rand() & 1)
+        {
+            bp_insert(&tree, key, (rand() & 1) ? malloc(1) : NULL, counting);
+            if (!counter[key]) counter[key] = 1, present++;
+            else if (counting) counter[key]++;
+        }
+        else
+        {
+            bp_delete(&tree, key, counting);
+            if (counter[key] && (!counting || !--counter[key])) counter[key] = 0, present--;
+        }
+        struct bpentry *e = bp_search(&tree, key);
+        assert(counter[key] ? e && e->counter == counter[key] : !e);
+
+        if (!(i % 10000) && tree.root)
+        {
+            int count = 0;
+            check(tree.root, LLONG_MIN, LLONG_MAX, true, &count);
+            assert(count == present);
+        }
+    }
+
+    // leaves are chained in key order
+    if (tree.root)
+    {
+        struct bpnode *n = tree.root;
+        long long last = -1;
+        int count = 0;
+        while (!n->leaf) n = n->child[0];
+        for (; n; n = n->next) for (int i = 0; i < n->count; i++, count++) assert(n->key[i] > last), last = n->key[i];
+        assert(count == present);
+    }
+
+    bp_destroy(&tree);
+    printf("Seems to be working...\n");
+    return 0;
+}
+#endif
+
+// To build the benchmark against the bst.c AVL tree:
+//   CFLAGS="-O3 -march=native -DBENCH" make -B bptree
+// Then run "./bptree [maxkeys]", by default 1K to 10M keys in powers of 10.
+// 100M keys needs about 8GB.
+#if defined(BENCH) && !defined(NOMAIN)
+#define BALANCE
+#define NOMAIN
+#include "bst.c"
+#include <stdio.h>
+#include <time.h>
+
+// xorshift64, good enough for benchmark keys
+static unsigned long long rnd(void)
+{
+    static unsigned long long x = 88172645463325252ULL;
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    return x;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    long max = (argc > 1) ? atol(argv[1]) : 10000000;
+
+    printf("%10s %8s %8s %8s %8s %8s %8s  (ns/key)\n", "keys", "avl ins", "bp ins", "avl get", "bp get", "avl del", "bp del");
+    for (long count = 1000; count <= max; count *= 10)
+    {
+        long long *keys = malloc(count * sizeof(long long));
+        struct pool pool = {0};
+        struct node *avl = NULL;
+        struct bptree bp = {0};
+        double t[7];
+        int rounds = (count < 1000000) ? 1000000 / count : 1;
+
+        if (!keys) abort();
+        for (long i = 0; i < count; i++) keys[i] = rnd() >> 1;
+
+        t[0] = now();
+        for (long i = 0; i < count; i++) avl = insert(&pool, avl, keys[i], NULL, false);
+        t[1] = now();
+        for (long i = 0; i < count; i++) bp_insert(&bp, keys[i], NULL, false);
+        t[2] = now();
+        for (int r = 0; r < rounds; r++) for (long i = 0; i < count; i++) if (!search(avl, keys[i])) abort();
+        t[3] = now();
+        for (int r = 0; r < rounds; r++) for (long i = 0; i < count; i++) if (!bp_search(&bp, keys[i])) abort();
+        t[4] = now();
+        for (long i = 0; i < count; i++) avl = delete(&pool, avl, keys[i], false);
+        t[5] = now();
+        for (long i = 0; i < count; i++) bp_delete(&bp, keys[i], false);
+        t[6] = now();
+
+        printf("%10ld %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n", count,
+               (t[1] - t[0]) * 1e9 / count, (t[2] - t[1]) * 1e9 / count,
+               (t[3] - t[2]) * 1e9 / count / rounds, (t[4] - t[3]) * 1e9 / count / rounds,
+               (t[5] - t[4]) * 1e9 / count, (t[6] - t[5]) * 1e9 / count);
+
+        if (avl || bp.root) abort();
+        destroy(&pool, avl);
+        free(keys);
+    }
+    return 0;
+}
+#endif
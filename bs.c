@@ -1,5 +1,10 @@
 // Optimized bubble sort. Useful for small data sets or in embedded context
 // where stack size is limited. Otherwise use quick sort!
+//
+// Also sorting networks for up to 32 elements, which are much faster than
+// bubble sort even for a handful of elements since they don't branch on the
+// data. qs.c uses them for small partitions.
+#include <stddef.h>
 
 // Given array of n ints, sort the array in place
 void bs(int *a, int n)
@@ -8,7 +13,138 @@ void bs(int *a, int n)
     while (n) for (l=n, n=0, i=1; i<l; i++) if (a[i] < a[i-1]) a[i]^=a[i-1], a[i-1]^=a[i], a[i]^=a[i-1], n=i;
 }
 
-#if 1
+#define SNET_MAX 32             // largest network
+
+// Batcher's odd-even merge sort for 32 elements, as calls to X(i, j) for each
+// compare-exchange of elements i and j. Each stage merges sorted runs of 1, 2,
+// 4, 8 and 16 elements into runs of twice the size. For n elements, stages
+// which only merge runs past the end and compare-exchanges past the end are
+// skipped, i.e. the missing elements are treated as infinite.
+#define SNET_NETWORK(X)                                                         \
+    X(0,1) X(2,3) X(4,5) X(6,7) X(8,9) X(10,11) X(12,13) X(14,15) X(16,17)      \
+    X(18,19) X(20,21) X(22,23) X(24,25) X(26,27) X(28,29) X(30,31)              \
+    if (n > 2)                                                                  \
+    {                                                                           \
+        X(0,2) X(1,3) X(4,6) X(5,7) X(8,10) X(9,11) X(12,14) X(13,15)           \
+        X(16,18) X(17,19) X(20,22) X(21,23) X(24,26) X(25,27) X(28,30)          \
+        X(29,31) X(1,2) X(5,6) X(9,10) X(13,14) X(17,18) X(21,22) X(25,26)      \
+        X(29,30)                                                                \
+    }                                                                           \
+    if (n > 4)                                                                  \
+    {                                                                           \
+        X(0,4) X(1,5) X(2,6) X(3,7) X(8,12) X(9,13) X(10,14) X(11,15)           \
+        X(16,20) X(17,21) X(18,22) X(19,23) X(24,28) X(25,29) X(26,30)          \
+        X(27,31) X(2,4) X(3,5) X(10,12) X(11,13) X(18,20) X(19,21) X(26,28)     \
+        X(27,29) X(1,2) X(3,4) X(5,6) X(9,10) X(11,12) X(13,14) X(17,18)        \
+        X(19,20) X(21,22) X(25,26) X(27,28) X(29,30)                            \
+    }                                                                           \
+    if (n > 8)                                                                  \
+    {                                                                           \
+        X(0,8) X(1,9) X(2,10) X(3,11) X(4,12) X(5,13) X(6,14) X(7,15)           \
+        X(16,24) X(17,25) X(18,26) X(19,27) X(20,28) X(21,29) X(22,30)          \
+        X(23,31) X(4,8) X(5,9) X(6,10) X(7,11) X(20,24) X(21,25) X(22,26)       \
+        X(23,27) X(2,4) X(3,5) X(6,8) X(7,9) X(10,12) X(11,13) X(18,20)         \
+        X(19,21) X(22,24) X(23,25) X(26,28) X(27,29) X(1,2) X(3,4) X(5,6)       \
+        X(7,8) X(9,10) X(11,12) X(13,14) X(17,18) X(19,20) X(21,22) X(23,24)    \
+        X(25,26) X(27,28) X(29,30)                                              \
+    }                                                                           \
+    if (n > 16)                                                                 \
+    {                                                                           \
+        X(0,16) X(1,17) X(2,18) X(3,19) X(4,20) X(5,21) X(6,22) X(7,23)         \
+        X(8,24) X(9,25) X(10,26) X(11,27) X(12,28) X(13,29) X(14,30) X(15,31)   \
+        X(8,16) X(9,17) X(10,18) X(11,19) X(12,20) X(13,21) X(14,22) X(15,23)   \
+        X(4,8) X(5,9) X(6,10) X(7,11) X(12,16) X(13,17) X(14,18) X(15,19)       \
+        X(20,24) X(21,25) X(22,26) X(23,27) X(2,4) X(3,5) X(6,8) X(7,9)         \
+        X(10,12) X(11,13) X(14,16) X(15,17) X(18,20) X(19,21) X(22,24)          \
+        X(23,25) X(26,28) X(27,29) X(1,2) X(3,4) X(5,6) X(7,8) X(9,10)          \
+        X(11,12) X(13,14) X(15,16) X(17,18) X(19,20) X(21,22) X(23,24)          \
+        X(25,26) X(27,28) X(29,30)                                              \
+    }
+
+#define SNET_CX(i, j) if (j < n) cx(a + i, a + j);
+
+// Define function "void name(type *a, size_t n)" to sort up to SNET_MAX
+// elements of the specified type in place, LESS is an expression of elements
+// x and y which is true if x sorts before y, see QSORT() in qs.c. The
+// compare-exchanges become conditional moves for scalar types so the time is
+// fixed for any n. If n is constant the function can be inlined as straight
+// line code.
+#define SNET(name, type, LESS)                                                  \
+static inline int name##_less(type x, type y) { return LESS; }                  \
+                                                                                \
+static inline void name##_cx(type *p, type *q)                                  \
+{                                                                               \
+    type x = *p;                                                                \
+    type y = *q;                                                                \
+    int c = name##_less(y, x);                                                  \
+    *p = c ? y : x;                                                             \
+    *q = c ? x : y;                                                             \
+}                                                                               \
+                                                                                \
+static inline void name(type *a, size_t n)                                      \
+{                                                                               \
+    void (*const cx)(type *, type *) = name##_cx;                               \
+    SNET_NETWORK(SNET_CX)                                                       \
+}
+
+SNET(sn, int, x < y)
+
+// Define NOMAIN to #include this file into another program.
+#if defined(BENCH) && !defined(NOMAIN)
+// To build the benchmark: CFLAGS="-O3 -DBENCH" make -B bs
+// Then run "./bs [count]", default one million. For each size from 2 to
+// SNET_MAX it sorts count arrays of random ints with bs() and sn(), and reports
+// ns per array.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64
+static unsigned long long rnd(void)
+{
+    static unsigned long long x = 88172645463325252ULL;
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    return x;
+}
+
+int main(int argc, char *argv[])
+{
+    int count = (argc > 1) ? atoi(argv[1]) : 1000000;
+    int *input = malloc((count + SNET_MAX) * sizeof(int));
+
+    if (!input) abort();
+    for (int i = 0; i < count + SNET_MAX; i++) input[i] = rnd();
+    printf("%4s %8s %8s  ns per array\n", "ints", "bs", "sn");
+    for (int n = 2; n <= SNET_MAX; n++)
+    {
+        double start, t[2];
+        for (int sort = 0; sort < 2; sort++)
+        {
+            start = now();
+            for (int r = 0; r < count; r++)
+            {
+                int v[SNET_MAX];
+                memcpy(v, input + r, n * sizeof(int));
+                if (sort) sn(v, n); else bs(v, n);
+                for (int i = 1; i < n; i++) if (v[i] < v[i-1]) abort();
+            }
+            t[sort] = (now() - start) * 1e9 / count;
+        }
+        printf("%4d %8.1f %8.1f\n", n, t[0], t[1]);
+    }
+    free(input);
+    return 0;
+}
+
+#elif !defined(NOMAIN)
 // POC, accept integers on command line and print sorted list, e.g.:
 //   ./bs $(for x in {1..10000}; do echo $RANDOM; done)
 #include <stdio.h>
@@ -18,7 +154,7 @@ int main(int argc , char *argv[])
 {
     int vs=argc-1, v[vs], x;
     for (x=0; x < vs; x++) v[x]=atoi(argv[x+1]);
-    bs(v, vs);
+    if (vs > 1 && vs <= SNET_MAX) sn(v, vs); else bs(v, vs);
     for (x=0; x < vs; x++) printf("%d\n",v[x]);
     return 0;
 }
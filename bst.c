@@ -1,7 +1,14 @@
 // Binary search tree. Define BALANCE to enable auto-balancing. This increases
 // code size and node insert/delete time but ensures O(logN) searches.
+// Define CONCURRENT for struct ctree, which allows lock-free searches while
+// other threads insert and delete (link with -pthread).
+// Define IMAGE to save trees to files which can be mapped and searched read-only.
+// Define RANK (with BALANCE) to track subtree sizes, for O(logN) rank() and
+// nth(). Also define MULTISET to count each key's counter toward the size
+// instead of 1.
 #include <stdlib.h>
 #include <stdbool.h>
+#include <limits.h>
 
 struct node
 {
@@ -12,8 +19,113 @@ struct node
 #ifdef BALANCE
     int height;
 #endif
+#ifdef RANK
+    long long size;             // weight of this node and its descendents
+#endif
+};
+
+#if defined(RANK) && !defined(BALANCE)
+#error "RANK requires BALANCE"
+#endif
+
+// Node pool. Nodes are carved from malloced slabs and recycled through a free
+// list, so insert() and delete() don't hit malloc and the nodes of a tree are
+// packed together in memory. Each tree should have its own pool, initialized
+// to all zeros. Pass a NULL pool to use plain malloc() and free() instead.
+#define SLAB 4096               // nodes per slab
+
+struct slab
+{
+    struct slab *next;
+    long long count;            // nodes in this slab
+    struct node node[];
 };
 
+struct pool
+{
+    struct slab *slabs;         // newest slab first
+    long long used;             // nodes used in the newest slab, others are full
+    struct node *free;          // free nodes, linked through ->right
+};
+
+// Add a slab of count nodes to the pool and return its first node. If full
+// is true the nodes are all in use, and the slab goes after the newest slab.
+static struct node *slab_alloc(struct pool *pool, long long count, bool full)
+{
+    struct slab *s = malloc(sizeof(struct slab) + count * sizeof(struct node));
+    if (!s) abort();
+    s->count = count;
+    if (full && pool->slabs)
+    {
+        s->next = pool->slabs->next;
+        pool->slabs->next = s;
+    }
+    else
+    {
+        s->next = pool->slabs;
+        pool->slabs = s;
+        pool->used = full ? count : 0;
+    }
+    return s->node;
+}
+
+// Return an uninitialized node from pool, or from malloc if pool is NULL
+static struct node *node_alloc(struct pool *pool)
+{
+    struct node *n;
+    if (!pool) n = malloc(sizeof(struct node));
+    else if (pool->free)
+    {
+        n = pool->free;
+        pool->free = n->right;
+    }
+    else
+    {
+        if (!pool->slabs || pool->used == pool->slabs->count) slab_alloc(pool, SLAB, false);
+        n = &pool->slabs->node[pool->used++];
+    }
+    if (!n) abort();
+    return n;
+}
+
+// Return node to pool, or to free() if pool is NULL. The node's value is not
+// freed.
+static void node_free(struct pool *pool, struct node *n)
+{
+    if (!pool)
+    {
+        free(n);
+        return;
+    }
+    n->value = NULL;            // so destroy() won't free it
+    n->right = pool->free;
+    pool->free = n;
+}
+
+#ifdef RANK
+// Return node's contribution to subtree size
+static inline long long weight(struct node *n)
+{
+#ifdef MULTISET
+    return n->counter;
+#else
+    return 1;
+#endif
+}
+
+// Return size of subtree, 0 if NULL
+static inline long long size(struct node *n)
+{
+    return n ? n->size : 0;
+}
+
+// Recompute node's size from its subnodes
+static inline void resize(struct node *n)
+{
+    n->size = size(n->left) + size(n->right) + weight(n);
+}
+#endif
+
 #ifdef BALANCE
 // Return height of node from heights of subnodes
 static int height (struct node *n)
@@ -40,6 +152,10 @@ static struct node *ror(struct node *A)
     B->right = A;
     A->height = height(A);
     B->height = height(B);
+#ifdef RANK
+    resize(A);
+    resize(B);
+#endif
     return B;
 }
 
@@ -58,6 +174,10 @@ static struct node *rol(struct node *A)
     B->left = A;
     A->height = height(A);
     B->height = height(B);
+#ifdef RANK
+    resize(A);
+    resize(B);
+#endif
     return B;
 }
 
@@ -67,154 +187,734 @@ static long long balance(struct node *n)
 {
     return n ? height(n->right) - height(n->left) : 0;
 }
+
+// Update node's height and rotate it if out of balance, return the new root
+// of the subtree.
+static struct node *rebalance(struct node *n)
+{
+    int bal;
+
+    n->height = height(n);
+#ifdef RANK
+    resize(n);
+#endif
+    bal = balance(n);
+    if (bal < -1)
+    {
+        if (balance(n->left) > 0) n->left = rol(n->left);
+        return ror(n);
+    }
+    if (bal > 1)
+    {
+        if (balance(n->right) < 0) n->right = ror(n->right);
+        return rol(n);
+    }
+    return n;
+}
+
+// Maximum path length, an AVL tree of 2^64 nodes is less than 93 high
+#define MAXDEPTH 96
+
+// Given the links walked from the root to a changed subtree, rebalance each
+// linked node from the bottom up. Stop as soon as a subtree's height is
+// unchanged, since nothing above it can be affected.
+static void retrace(struct node ***path, int depth)
+{
+    while (depth > 0)
+    {
+        struct node **link = path[--depth];
+        int h = (*link)->height;
+        *link = rebalance(*link);
+        if ((*link)->height == h) break;
+    }
+#ifdef RANK
+    // but sizes change all the way up
+    while (depth > 0) resize(*path[--depth]);
+#endif
+}
+
+#if defined(RANK) && defined(MULTISET)
+// Add delta to the size of node n and the nodes linked from the path
+static void adjust(struct node ***path, int depth, struct node *n, int delta)
+{
+    n->size += delta;
+    while (depth > 0) (*path[--depth])->size += delta;
+}
+#endif
+
+// Remember a link walked by insert() or delete()
+#define PUSH(link) (path[depth++] = (link))
+#else
+#define PUSH(link)
 #endif
 
-// Insert key and value into tree.
+// Insert key and value into tree, return the new root.
 // If key already exists, just replace the value.
 // Note *value must either be NULL or malloced.
 // If counting then increment counter if key exists.
-static struct node *insert(struct node *n, long long key, void *value, bool counting)
+// Nodes come from the pool, or from malloc if pool is NULL.
+// This does not recurse, so the unbalanced tree can grow arbitrarily deep.
+static struct node *insert(struct pool *pool, struct node *root, long long key, void *value, bool counting)
 {
+    struct node **link = &root, *n;
 #ifdef BALANCE
-    int bal;
+    struct node **path[MAXDEPTH];
+    int depth = 0;
 #endif
 
-    if (!n)
+    while ((n = *link))
     {
-        n = calloc(1,sizeof(struct node));
-        if (!n) abort();
-        n->key = key;
-        n->value = value;
-        n->counter = 1;
+        if (key == n->key)
+        {
+            if (n->value) free(n->value);
+            n->value = value;
+            if (counting)
+            {
+                n->counter++;
+#if defined(RANK) && defined(MULTISET)
+                adjust(path, depth, n, 1);
+#endif
+            }
+            return root;
+        }
+        PUSH(link);
+        link = (key < n->key) ? &n->left : &n->right;
+    }
+
+    n = *link = node_alloc(pool);
+    n->key = key;
+    n->value = value;
+    n->counter = 1;
+    n->left = n->right = NULL;
+#ifdef RANK
+    n->size = 1;
+#endif
+#ifdef BALANCE
+    n->height = 1;
+    retrace(path, depth);
+#endif
+
+    return root;
+}
+
+// Delete key from tree if it exists, return the new root. If counting, only
+// delete when node counter decrements to 0. Pool must be the same one passed
+// to insert().
+struct node *delete(struct pool *pool, struct node *root, long long key, bool counting)
+{
+    struct node **link = &root, *n;
 #ifdef BALANCE
-        n->height = 1;
+    struct node **path[MAXDEPTH];
+    int depth = 0;
 #endif
-        return n;
+
+    while ((n = *link) && key != n->key)
+    {
+        PUSH(link);
+        link = (key < n->key) ? &n->left : &n->right;
     }
 
-    if (key == n->key)
+    if (!n) return root;
+    if (counting && --n->counter)
     {
-        if (n->value) free(n->value);
-        n->value = value;
-        if (counting) n->counter++;
-        return n;
+        // just decrement the count
+#if defined(RANK) && defined(MULTISET)
+        adjust(path, depth, n, -1);
+#endif
+        return root;
     }
 
-    if (key <= n->key)
-        n->left = insert(n->left, key, value, counting);
-    else
-        n->right = insert(n->right, key, value, counting);
+    if (n->value) free(n->value);
+
+    if (n->left && n->right)
+    {
+        // two children, find the successor to this node
+        struct node *successor;
+        PUSH(link);
+        link = &n->right;
+        while ((successor = *link)->left)
+        {
+            PUSH(link);
+            link = &successor->left;
+        }
+        // clone successor's key, value, and counter, then delete the successor instead
+        n->key = successor->key;
+        n->value = successor->value;
+        n->counter = successor->counter;
+        n = successor;
+    }
+
+    // now n has at most one child, replace it with the child
+    *link = n->left ?: n->right;
+    node_free(pool, n);
 
 #ifdef BALANCE
-    // re-balance
-    n->height = height(n);
-    bal = balance(n);
-    if (bal < -1)
+    retrace(path, depth);
+#endif
+
+    return root;
+}
+
+// Return node containing specified key, or NULL
+struct node *search(struct node *n, long long key)
+{
+    while (n)
+    {
+        if (key < n->key) n = n->left;
+        else if (key > n->key) n = n->right;
+        else break;
+    }
+    return n;
+}
+
+// Return node with the smallest key >= specified key, or NULL
+struct node *lower_bound(struct node *n, long long key)
+{
+    struct node *found = NULL;
+    while (n)
+    {
+        if (n->key >= key) found = n, n = n->left;
+        else n = n->right;
+    }
+    return found;
+}
+
+// Return node with the smallest key > specified key, or NULL
+struct node *upper_bound(struct node *n, long long key)
+{
+    struct node *found = NULL;
+    while (n)
+    {
+        if (n->key > key) found = n, n = n->left;
+        else n = n->right;
+    }
+    return found;
+}
+
+#ifdef RANK
+// Return the number of keys less than specified key. With MULTISET, each key
+// counts its counter.
+long long rank(struct node *n, long long key)
+{
+    long long r = 0;
+    while (n)
     {
-        if (key < n->left->key) return ror(n);
-        if (key >= n->left->key)
+        if (key <= n->key) n = n->left;
+        else
         {
-            n->left = rol(n->left);
-            return ror(n);
+            r += size(n->left) + weight(n);
+            n = n->right;
         }
     }
-    else if (bal > 1)
+    return r;
+}
+
+// Return the node with the kth smallest key, counting from 0, or NULL if k is
+// out of range. With MULTISET, a key with counter c occupies c positions.
+struct node *nth(struct node *n, long long k)
+{
+    while (n)
     {
-        if (key > n->right->key) return rol(n);
-        if (key <= n->right->key)
+        if (k < size(n->left)) n = n->left;
+        else
         {
-            n->right = ror(n->right);
-            return rol(n);
+            k -= size(n->left);
+            if (k < weight(n)) break;
+            k -= weight(n);
+            n = n->right;
         }
     }
+    return n;
+}
 #endif
 
+// In-order iterator. The stack holds nodes whose keys are yet to be returned,
+// it grows on demand since an unbalanced tree can be arbitrarily deep.
+// Initialize to all zeros, and call iter_end() when done.
+struct iter
+{
+    struct node **stack;
+    int depth, size;
+    bool reverse;
+};
+
+static void iter_push(struct iter *it, struct node *n)
+{
+    if (it->depth == it->size)
+    {
+        it->size = it->size ? it->size * 2 : 64;
+        it->stack = realloc(it->stack, it->size * sizeof(struct node *));
+        if (!it->stack) abort();
+    }
+    it->stack[it->depth++] = n;
+}
+
+// Position iterator at the first node with key >= specified key, or if
+// reverse at the last node with key <= specified key. Use LLONG_MIN or
+// LLONG_MAX to start from the first or last node.
+void iter_seek(struct iter *it, struct node *n, long long key, bool reverse)
+{
+    it->depth = 0;
+    it->reverse = reverse;
+    while (n)
+    {
+        if (reverse ? n->key > key : n->key < key) n = reverse ? n->left : n->right;
+        else
+        {
+            iter_push(it, n);
+            n = reverse ? n->right : n->left;
+        }
+    }
+}
+
+// Return the current node and advance to the next, or return NULL at the end.
+// The tree must not be changed while iterating.
+struct node *iter_next(struct iter *it)
+{
+    struct node *n, *c;
+    if (!it->depth) return NULL;
+    n = it->stack[--it->depth];
+    for (c = it->reverse ? n->left : n->right; c; c = it->reverse ? c->right : c->left) iter_push(it, c);
     return n;
 }
 
-// Delete key from tree if it exists. If counting, only delete when node
-// counter decrements to 0.
-struct node *delete(struct node *n, long long key, bool counting)
+// Release the iterator stack
+void iter_end(struct iter *it)
+{
+    free(it->stack);
+    it->stack = NULL;
+    it->depth = it->size = 0;
+}
+
+// Call fn for each node with key in [lo, hi] in order, stop early if fn
+// returns non-zero. Return the number of nodes visited.
+long long range(struct node *n, long long lo, long long hi, int (*fn)(struct node *, void *), void *arg)
 {
+    struct iter it = {0};
+    long long visited = 0;
+    iter_seek(&it, n, lo, false);
+    while ((n = iter_next(&it)) && n->key <= hi)
+    {
+        visited++;
+        if (fn(n, arg)) break;
+    }
+    iter_end(&it);
+    return visited;
+}
+
+// Flatten tree into a list in key order, linked through ->right, by rotating
+// left children up. Return the head of the list and add the node count to
+// *count.
+static struct node *vine(struct node *root, long long *count)
+{
+    struct node **link = &root, *n;
+    while ((n = *link))
+    {
+        if (n->left)
+        {
+            struct node *l = n->left;
+            n->left = l->right;
+            l->right = n;
+            *link = l;
+        }
+        else
+        {
+            link = &n->right;
+            ++*count;
+        }
+    }
+    return root;
+}
+
+// Consume count nodes from the head of a list linked through ->right, and
+// return them as a perfectly balanced tree.
+static struct node *treeify(struct node **list, long long count)
+{
+    struct node *n, *left;
+    if (!count) return NULL;
+    left = treeify(list, count / 2);
+    n = *list;
+    *list = n->right;
+    n->left = left;
+    n->right = treeify(list, count - count / 2 - 1);
 #ifdef BALANCE
-    int bal;
+    n->height = height(n);
 #endif
+#ifdef RANK
+    resize(n);
+#endif
+    return n;
+}
 
-    if (!n) return NULL;
+// Build a balanced tree from count keys in ascending order, and their values
+// (or NULL for no values), in O(N). Duplicate keys are merged as by insert().
+// With a pool, all nodes are allocated at once.
+struct node *build(struct pool *pool, long long *keys, void **values, long long count, bool counting)
+{
+    struct node *nodes = NULL, *head = NULL, **tail = &head, *n = NULL;
+    long long unique = 0;
 
-    if (key < n->key) n->left = delete(n->left, key, counting);
-    else if (key > n->key) n->right = delete(n->right, key, counting);
-    else
+    for (long long i = 0; i < count; i++) unique += !i || keys[i] != keys[i-1];
+    if (pool && unique) nodes = slab_alloc(pool, unique, true);
+
+    for (long long i = 0; i < count; i++)
     {
-        // ok, delete this node
-        if (counting && --n->counter) return n; // maybe just decrement the count to 0
+        void *value = values ? values[i] : NULL;
+        if (i && keys[i] == keys[i-1])
+        {
+            if (n->value) free(n->value);
+            n->value = value;
+            if (counting) n->counter++;
+            continue;
+        }
+        n = nodes ? nodes++ : node_alloc(NULL);
+        n->key = keys[i];
+        n->value = value;
+        n->counter = 1;
+        *tail = n;
+        tail = &n->right;
+    }
+    *tail = NULL;
 
-        if (n->value) free(n->value);
+    return treeify(&head, unique);
+}
+
+// Merge tree b into tree a and return the new root, in O(N). For keys found
+// in both, b's value replaces a's and if counting the counters are added.
+// Both trees must be from the same pool. The result is perfectly balanced.
+struct node *merge(struct pool *pool, struct node *a, struct node *b, bool counting)
+{
+    struct node *head = NULL, **tail = &head;
+    long long count = 0, dups = 0;
 
-        if (!n->left && !n->right)
+    a = vine(a, &count);
+    b = vine(b, &count);
+    while (a && b)
+    {
+        if (a->key == b->key)
         {
-            // no children
-            free(n);
-            return NULL;
+            struct node *t = b;
+            if (a->value) free(a->value);
+            a->value = b->value;
+            if (counting) a->counter += b->counter;
+            b = b->right;
+            node_free(pool, t);
+            dups++;
         }
-        if (!n->left || !n->right)
+        else if (a->key < b->key)
         {
-            // one child
-            struct node *t = n->left?:n->right;
-            *n = *t; // memcpy
-            free(t);
+            *tail = a;
+            tail = &a->right;
+            a = a->right;
         }
         else
         {
-            // two children, find the successor to this mode
-            struct node *successor = n->right;
-            while (successor->left) successor = successor->left;
-            // clone successor's key, value, and counter
-            n->key = successor->key;
-            n->value = successor->value;
-            n->counter = successor->counter;
-            // then delete the succcessor
-            successor->value = NULL;                    // there can only be one
-            n->right = delete(n->right, n->key, false);
+            *tail = b;
+            tail = &b->right;
+            b = b->right;
         }
     }
+    *tail = a ?: b;
 
-#ifdef BALANCE
-    n->height = height(n);
-    bal = balance(n);
-    if (bal < -1)
+    return treeify(&head, count - dups);
+}
+
+// Free the tree and all its values. If pool is not NULL then all of its slabs
+// are released in one pass, along with any other tree that shares the pool,
+// and the pool is left empty and reusable. Otherwise the nodes are freed one
+// at a time, without recursion.
+void destroy(struct pool *pool, struct node *n)
+{
+    if (pool)
     {
-        if (balance(n->left) <= 0) return ror(n);
-        n->left = rol(n->left);
-        return ror(n);
+        long long used = pool->used;    // only the newest slab is partially used
+        while (pool->slabs)
+        {
+            struct slab *s = pool->slabs;
+            for (long long i = 0; i < used; i++) if (s->node[i].value) free(s->node[i].value);
+            pool->slabs = s->next;
+            free(s);
+            if (pool->slabs) used = pool->slabs->count;
+        }
+        pool->used = 0;
+        pool->free = NULL;
+        return;
     }
 
-    if (bal > 1)
+    while (n)
     {
-        if (balance(n->right) >= 0) return rol(n);
-        n->right = ror(n->right);
-        return rol(n);
+        if (n->left)
+        {
+            // rotate the left child up, eventually the tree becomes a list
+            struct node *l = n->left;
+            n->left = l->right;
+            l->right = n;
+            n = l;
+        }
+        else
+        {
+            struct node *r = n->right;
+            if (n->value) free(n->value);
+            free(n);
+            n = r;
+        }
+    }
+}
+
+#ifdef IMAGE
+// Tree image file, which can be mmapped and searched in place without
+// deserialization. The header is followed by one record per node, sorted into
+// breadth first (Eytzinger) order so the children of record i are records
+// 2i+1 and 2i+2, and then by the values. Values are located by their offset
+// from the start of the file, so the image is position independent. Numbers
+// are in host byte order.
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAGIC "BSTIMG01"
+
+struct record
+{
+    long long key;
+    long long value;            // offset of value in the file, or 0 if none
+    int length;                 // length of value
+    int counter;
+};
+
+struct image
+{
+    char magic[8];
+    long long count;            // number of records
+    long long size;             // size of file
+    struct record record[];
+};
+
+// Store in-order nodes from the iterator into breadth first position k
+static void image_fill(struct iter *it, struct record *r, void **values, long long k, long long count)
+{
+    struct node *n;
+    if (k >= count) return;
+    image_fill(it, r, values, 2*k + 1, count);
+    n = iter_next(it);
+    r[k].key = n->key;
+    r[k].counter = n->counter;
+    values[k] = n->value;
+    image_fill(it, r, values, 2*k + 2, count);
+}
+
+// Write tree to an image file. If length is not NULL, it's called to get the
+// length of each non-NULL value, and the value bytes are written to the image
+// too. Return 0 or -1 on error, including a value longer than INT_MAX.
+int image_save(struct node *root, char *path, size_t (*length)(void *value))
+{
+    struct iter it = {0};
+    struct image header = { MAGIC };
+    struct record *records;
+    void **values;
+    long long offset;
+    FILE *f = NULL;
+    int ok = 1;
+
+    iter_seek(&it, root, LLONG_MIN, false);
+    while (iter_next(&it)) header.count++;
+
+    records = calloc(header.count + 1, sizeof(struct record));
+    values = calloc(header.count + 1, sizeof(void *));
+    if (!records || !values) abort();
+
+    iter_seek(&it, root, LLONG_MIN, false);
+    image_fill(&it, records, values, 0, header.count);
+    iter_end(&it);
+
+    // values follow the records, each 8-byte aligned
+    offset = sizeof(struct image) + header.count * sizeof(struct record);
+    for (long long i = 0; ok && i < header.count; i++)
+    {
+        size_t l;
+        if (!length || !values[i]) continue;
+        if ((l = length(values[i])) > INT_MAX) ok = 0;
+        records[i].length = l;
+        records[i].value = offset;
+        offset += (l + 7) & ~7;
+    }
+    header.size = offset;
+
+    ok = ok && (f = fopen(path, "w")) &&
+         fwrite(&header, sizeof header, 1, f) == 1 &&
+         fwrite(records, sizeof(struct record), header.count, f) == header.count;
+    for (long long i = 0; ok && i < header.count; i++)
+        if (records[i].value)
+            ok = fwrite(values[i], 1, records[i].length, f) == records[i].length &&
+                 fwrite("\0\0\0\0\0\0\0", 1, -records[i].length & 7, f) == (-records[i].length & 7);
+    if (f && fclose(f)) ok = 0;
+
+    free(records);
+    free(values);
+    return ok ? 0 : -1;
+}
+
+// Map an image file read-only and return pointer, or NULL on error
+struct image *image_open(char *path)
+{
+    struct image *image = NULL;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) return NULL;
+    if (!fstat(fd, &st) && st.st_size >= sizeof(struct image))
+    {
+        image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (image == MAP_FAILED) image = NULL;
+        else if (memcmp(image->magic, MAGIC, 8) || image->size != st.st_size || image->count < 0 ||
+                 image->count > (st.st_size - sizeof(struct image)) / sizeof(struct record))
+        {
+            munmap(image, st.st_size);
+            image = NULL;
+        }
     }
+    close(fd);
+    return image;
+}
+
+// Return the record containing specified key, or NULL
+struct record *image_search(struct image *image, long long key)
+{
+    long long k = 0;
+    while (k < image->count)
+    {
+        struct record *r = &image->record[k];
+        if (key == r->key) return r;
+        k = 2*k + 1 + (key > r->key);
+    }
+    return NULL;
+}
+
+// Return pointer to record's value in the image, or NULL if it has none or the
+// record doesn't point inside the values
+void *image_value(struct image *image, struct record *r)
+{
+    if (!r->value || r->value < (long long)(sizeof(struct image) + image->count * sizeof(struct record)) ||
+        r->length < 0 || r->length > image->size - r->value) return NULL;
+    return (char *)image + r->value;
+}
+
+// Unmap image
+void image_close(struct image *image)
+{
+    munmap(image, image->size);
+}
 #endif
 
-    return n;
+#ifdef CONCURRENT
+// Concurrent tree for many readers and occasional writers. Writers serialize
+// on a mutex and bump a sequence number before and after each change, so the
+// number is odd while a change is in progress. Readers take no lock, they
+// search optimistically then retry if the sequence number changed. Nodes come
+// from the tree's pool which doesn't release memory until cdestroy(), so a
+// reader racing a writer may see stale nodes but never freed memory.
+// Writers change nodes with the plain stores of insert() and delete() while
+// readers use atomic loads, which formally is a C11 data race. This relies on
+// GCC on x86 and the like storing aligned words in one piece, so a reader sees
+// either the old or the new link or key and the sequence check does the rest.
+// Initialize with: struct ctree t = { .lock = PTHREAD_MUTEX_INITIALIZER };
+#include <pthread.h>
+#include <sched.h>
+
+struct ctree
+{
+    struct node *root;
+    unsigned long seq;
+    pthread_mutex_t lock;
+    struct pool pool;
+};
+
+static void cbegin(struct ctree *t)
+{
+    pthread_mutex_lock(&t->lock);
+    __atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 }
 
-// Return node containing specified key, or NULL
-struct node *search(struct node *n, long long key)
+static void cend(struct ctree *t)
 {
-    while (n)
+    __atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&t->lock);
+}
+
+// Insert, see insert()
+void cinsert(struct ctree *t, long long key, void *value, bool counting)
+{
+    cbegin(t);
+    __atomic_store_n(&t->root, insert(&t->pool, t->root, key, value, counting), __ATOMIC_RELAXED);
+    cend(t);
+}
+
+// Delete, see delete()
+void cdelete(struct ctree *t, long long key, bool counting)
+{
+    cbegin(t);
+    __atomic_store_n(&t->root, delete(&t->pool, t->root, key, counting), __ATOMIC_RELAXED);
+    cend(t);
+}
+
+// Search for key without locking. If found, return true and copy the node's
+// value and counter to *value and *counter, unless they are NULL. Note the
+// value is still owned by the tree, it's only safe to dereference if writers
+// never replace or delete it while readers are active.
+bool csearch(struct ctree *t, long long key, void **value, int *counter)
+{
+    while (1)
     {
-        if (key < n->key) n = n->left;
-        else if (key > n->key) n = n->right;
-        else break;
+        unsigned long seq = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE);
+        struct node *n;
+        long long k = 0;
+        int steps = 0;
+
+        if (seq & 1)
+        {
+            // writer active, let it run
+            sched_yield();
+            continue;
+        }
+
+        n = __atomic_load_n(&t->root, __ATOMIC_RELAXED);
+        while (n && (k = __atomic_load_n(&n->key, __ATOMIC_RELAXED)) != key)
+        {
+            n = __atomic_load_n((key < k) ? &n->left : &n->right, __ATOMIC_RELAXED);
+            // a stale read could loop, check periodically
+            if (!(++steps & 63) && __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE) != seq) break;
+        }
+
+        void *v = n ? __atomic_load_n(&n->value, __ATOMIC_RELAXED) : NULL;
+        int c = n ? __atomic_load_n(&n->counter, __ATOMIC_RELAXED) : 0;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&t->seq, __ATOMIC_RELAXED) != seq) continue; // changed, try again
+
+        if (!n) return false;
+        if (value) *value = v;
+        if (counter) *counter = c;
+        return true;
     }
-    return n;
 }
 
+// Free the tree and its pool, there must be no other threads using it
+void cdestroy(struct ctree *t)
+{
+    destroy(&t->pool, t->root);
+    t->root = NULL;
+}
+#endif
+
 // To build the proof-of-concept:   CFLAGS=-DPOC make -B bst
 // To build the POC with balancing: CFLAGS="-DPOC -DBALANCE" make -B bst
-#ifdef POC
+// Add -DRANK, or -DRANK -DMULTISET, to test rank and nth.
+// Define NOMAIN to #include this file into another program.
+#if defined(POC) && !defined(NOMAIN)
 #include <stdio.h>
 #include <string.h>
 
@@ -226,14 +926,30 @@ long long hash(char *key)
     return h;
 }
 
-// All the animals live in a tree.
+// All the animals live in a tree, and the tree lives in a pool.
 struct node *tree = NULL;
+struct pool pool;
+
+#ifdef RANK
+// Check each node's size is the sum of the weights in its subtree, return the
+// size
+long long sizes(struct node *n)
+{
+    if (!n) return 0;
+    if (n->size != sizes(n->left) + sizes(n->right) + weight(n)) abort();
+    return n->size;
+}
+#endif
 
 // If specified animal is in the tree report count, name, and sound.
-// Otherwise, "Animal is a myth".
+// Otherwise, "Animal is a myth". With RANK, also check the sizes since this
+// follows every change.
 void say(char *animal)
 {
     struct node *n = search(tree, hash(animal));
+#ifdef RANK
+    sizes(tree);
+#endif
     if (!n) printf("The %s is a myth.\n", animal);
     else if (!n->value)
     {
@@ -252,36 +968,113 @@ void add(char *animal, char *sound)
 {
     long long h = hash(animal);
     struct node *n;
-    if (!sound && (n = search(tree, h)))
-        // sound is NULL and animal exists, just increment it
-        n -> counter++;
-    else
-        // else insert or update animal
-        tree = insert(tree, h, sound ? strdup(sound) : NULL, true);
+    if (!sound && (n = search(tree, h)) && n->value)
+        // sound is NULL and animal exists, keep its sound. Still increment it
+        // with insert() so it can update the sizes.
+        sound = n->value;
+    tree = insert(&pool, tree, h, sound ? strdup(sound) : NULL, true);
     say(animal);
 }
 
 // Add animal if not in tree, or just replace its sound.
 void replace(char *animal, char *sound)
 {
-    tree = insert(tree, hash(animal), sound ? strdup(sound) : NULL, false);
+    tree = insert(&pool, tree, hash(animal), sound ? strdup(sound) : NULL, false);
     say(animal);
 }
 
 // Remove one of specified animal.
 void kill(char *animal)
 {
-    tree = delete(tree, hash(animal), true);
+    tree = delete(&pool, tree, hash(animal), true);
     say(animal);
 }
 
 // Remove all of specified animals.
 void extinct(char *animal)
 {
-    tree = delete(tree, hash(animal), false);
+    tree = delete(&pool, tree, hash(animal), false);
     say(animal); // should always be "a myth"
 }
 
+// Range callback, count nodes and animals
+int count(struct node *n, void *census)
+{
+    ((int *)census)[0]++;
+    ((int *)census)[1] += n->counter;
+    return 0;
+}
+
+// qsort callback for keys
+int compare(const void *a, const void *b)
+{
+    long long x = *(long long *)a, y = *(long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Return the key of node n, or LLONG_MAX if NULL
+long long key(struct node *n)
+{
+    return n ? n->key : LLONG_MAX;
+}
+
+// Seek to key and check the iterator returns k[i] onwards, or if reverse
+// k[i-1] back to k[0]
+void seek(struct iter *it, long long key, bool reverse, long long *k, int count, int i)
+{
+    struct node *n;
+    iter_seek(it, tree, key, reverse);
+    if (reverse)
+    {
+        while ((n = iter_next(it))) if (!i || n->key != k[--i]) abort();
+        if (i) abort();
+    } else
+    {
+        while ((n = iter_next(it))) if (i == count || n->key != k[i++]) abort();
+        if (i != count) abort();
+    }
+}
+
+// Check iterators and bounds against the sorted keys of the named animals,
+// which must be exactly the animals in the tree
+void order(char **animals, int count)
+{
+    long long k[count];
+    struct iter it = {0};
+    int i;
+
+    for (i = 0; i < count; i++) k[i] = hash(animals[i]);
+    qsort(k, count, sizeof(long long), compare);
+
+    // forward and reverse from the ends
+    seek(&it, LLONG_MIN, false, k, count, 0);
+    seek(&it, LLONG_MAX, true, k, count, count);
+
+    // bounds of present and missing keys, and past both ends
+    if (key(lower_bound(tree, LLONG_MIN)) != k[0] || key(upper_bound(tree, k[0] - 1)) != k[0]) abort();
+    if (lower_bound(tree, k[count-1] + 1) || upper_bound(tree, k[count-1])) abort();
+    for (i = 0; i < count; i++)
+    {
+        long long next = (i < count - 1) ? k[i+1] : LLONG_MAX;
+        if (key(lower_bound(tree, k[i])) != k[i] || key(upper_bound(tree, k[i])) != next) abort();
+        if (key(lower_bound(tree, k[i] - 1)) != k[i] || key(lower_bound(tree, k[i] + 1)) != next) abort();
+        if (key(upper_bound(tree, k[i] - 1)) != k[i]) abort();
+    }
+
+    // seek to each key and to missing keys either side, in both directions
+    for (i = 0; i < count; i++)
+    {
+        seek(&it, k[i], false, k, count, i);
+        seek(&it, k[i], true, k, count, i + 1);
+        seek(&it, k[i] - 1, false, k, count, i);
+        seek(&it, k[i] + 1, true, k, count, i + 1);
+    }
+    seek(&it, k[count-1] + 1, false, k, count, count);
+    seek(&it, k[0] - 1, true, k, count, 0);
+    iter_end(&it);
+    printf("Iterators and bounds agree for %d animals\n", count);
+}
+
 void dump(struct node *n)
 {
     if (!n) return;
@@ -323,11 +1116,28 @@ int main(int argc , char *argv[])
     // Dump the tree, will be right-leaning if BALANCE not defined.
     dump(tree);
 
+    // Census of all keys, "11 kinds of animal, 13 in all"
+    int census[2] = {0};
+    range(tree, LLONG_MIN, LLONG_MAX, count, census);
+    printf("%d kinds of animal, %d in all\n", census[0], census[1]);
+    order((char *[]){"ox", "cat", "cow", "dog", "bird", "lion", "horse", "pig", "rabbit", "owl", "unicorn"}, 11);
+
+#ifdef RANK
+    // The kth animal's rank is k, or up to k with MULTISET
+    for (int k = 0; k < size(tree); k++)
+    {
+        struct node *n = nth(tree, k);
+        if (rank(tree, n->key) > k || rank(tree, n->key) + weight(n) <= k) abort();
+    }
+    printf("Rank and nth agree for %lld animals\n", size(tree));
+#endif
+
     kill("dog");                        // The dog is a myth.
     kill("owl");                        // The owl is a myth.
     kill("owl");                        // The owl is a myth.
 
     dump(tree);
+    order((char *[]){"ox", "cat", "cow", "bird", "lion", "horse", "pig", "rabbit", "unicorn"}, 9);
 
     // Make valgrind happy
     kill("ox");                         // "The ox is a myth."
@@ -342,6 +1152,312 @@ int main(int argc , char *argv[])
 
     dump(tree);                         // no output
 
+    destroy(&pool, tree);               // release the slabs
+    return 0;
+}
+#endif
+
+// To build the allocator benchmark:   CFLAGS="-O2 -DBENCH" make -B bst
+// With balancing:                    CFLAGS="-O2 -DBENCH -DBALANCE" make -B bst
+// Then run "./bst [keys]". Each pass inserts random keys, churns them by
+// deleting and re-inserting, then destroys the tree, first with malloc nodes
+// then with a pool.
+// Or run "./bst sorted [keys]" to insert and delete sorted keys, 10M by
+// default. Without BALANCE the tree degenerates into a list as deep as the
+// number of keys and insert is quadratic, so the default is 30K.
+// Or run "./bst bulk [keys]" to compare loading sorted keys with insert() and
+// build(), and merging two trees with insert() and merge().
+// Or add -DIMAGE and run "./bst image [keys]" to compare rebuilding a tree by
+// insert() with saving it and then mapping and searching the image.
+// Or add -DCONCURRENT and LDLIBS=-pthread and run "./bst threads [max]" to
+// measure reads/sec with 1 to max reader threads (default 64), while one
+// writer deletes and re-inserts a key every 10 uS. Readers either lock a mutex around
+// search() or use csearch().
+#if defined(BENCH) && !defined(NOMAIN)
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef BALANCE
+#define SORTED 10000000         // default sorted keys
+#else
+#define SORTED 30000
+#endif
+
+// xorshift64, good enough for benchmark keys
+static unsigned long long rnd(void)
+{
+    static unsigned long long x = 88172645463325252ULL;
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    return x;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(char *name, struct pool *pool, long long *keys, int count)
+{
+    struct node *tree = NULL;
+    double start = now(), t;
+
+    for (int i = 0; i < count; i++) tree = insert(pool, tree, keys[i], NULL, false);
+    t = now(); printf("%-6s insert  %6.1f ns/key\n", name, (t - start) * 1e9 / count); start = t;
+
+    for (int i = 0; i < count; i++)
+    {
+        tree = delete(pool, tree, keys[i], false);
+        keys[i] = rnd() >> 1;
+        tree = insert(pool, tree, keys[i], NULL, false);
+    }
+    t = now(); printf("%-6s churn   %6.1f ns/key\n", name, (t - start) * 1e9 / count); start = t;
+
+    for (int i = 0; i < count; i++) if (!search(tree, keys[i])) abort();
+    t = now(); printf("%-6s search  %6.1f ns/key\n", name, (t - start) * 1e9 / count); start = t;
+
+    destroy(pool, tree);
+    t = now(); printf("%-6s destroy %6.1f ns/key\n", name, (t - start) * 1e9 / count);
+}
+
+// Insert then delete sorted keys, which will degenerate an unbalanced tree
+static void sorted(int count)
+{
+    struct pool pool = {0};
+    struct node *tree = NULL;
+    double start = now(), t;
+
+    for (int i = 0; i < count; i++) tree = insert(&pool, tree, i, NULL, false);
+    t = now(); printf("sorted insert %6.1f ns/key\n", (t - start) * 1e9 / count); start = t;
+#ifdef BALANCE
+    printf("height %d\n", tree->height);
+#else
+    printf("height %d\n", count);
+#endif
+
+    for (int i = 0; i < count; i++) if (!search(tree, i)) abort();
+    t = now(); printf("sorted search %6.1f ns/key\n", (t - start) * 1e9 / count); start = t;
+
+    for (int i = 0; i < count; i++) tree = delete(&pool, tree, i, false);
+    t = now(); printf("sorted delete %6.1f ns/key\n", (t - start) * 1e9 / count);
+
+    if (tree) abort();
+    destroy(&pool, tree);
+}
+
+// Load sorted keys and merge trees, one at a time then in bulk
+static void bulk(int count)
+{
+    struct pool pool = {0};
+    struct node *a = NULL, *b = NULL;
+    long long *keys = malloc(count * sizeof(long long));
+    double start, t;
+
+    if (!keys) abort();
+    for (int i = 0; i < count; i++) keys[i] = i * 2LL;
+
+    start = now();
+    for (int i = 0; i < count; i++) a = insert(&pool, a, keys[i], NULL, false);
+    t = now(); printf("insert load  %8.1f mS\n", (t - start) * 1e3); start = t;
+    for (int i = 0; i < count; i++) a = insert(&pool, a, keys[i] + 1, NULL, false);
+    t = now(); printf("insert merge %8.1f mS\n", (t - start) * 1e3);
+    destroy(&pool, a);
+
+    start = now();
+    a = build(&pool, keys, NULL, count, false);
+    t = now(); printf("build load   %8.1f mS\n", (t - start) * 1e3);
+    for (int i = 0; i < count; i++) keys[i]++;
+    b = build(&pool, keys, NULL, count, false);
+    start = now();
+    a = merge(&pool, a, b, false);
+    t = now(); printf("merge        %8.1f mS\n", (t - start) * 1e3);
+
+    for (int i = 0; i < count * 2; i++) if (!search(a, i)) abort();
+    destroy(&pool, a);
+    free(keys);
+}
+
+#ifdef IMAGE
+// Return length of string value, including the NUL
+static size_t length(void *value)
+{
+    return strlen(value) + 1;
+}
+
+// Rebuild a tree by insertion, versus save and map it
+static void image(int count)
+{
+    struct pool pool = {0};
+    struct node *tree = NULL;
+    struct image *image;
+    long long *keys = malloc(count * sizeof(long long));
+    double start, t;
+    char buf[32];
+
+    if (!keys) abort();
+    for (int i = 0; i < count; i++) keys[i] = rnd() >> 1;
+
+    start = now();
+    for (int i = 0; i < count; i++)
+    {
+        sprintf(buf, "%d", i);
+        tree = insert(&pool, tree, keys[i], strdup(buf), false);
+    }
+    t = now(); printf("insert  %8.1f mS\n", (t - start) * 1e3); start = t;
+    if (image_save(tree, "bst.img", length)) abort();
+    t = now(); printf("save    %8.1f mS\n", (t - start) * 1e3); start = t;
+    if (!(image = image_open("bst.img"))) abort();
+    t = now(); printf("open    %8.1f mS\n", (t - start) * 1e3); start = t;
+    for (int i = 0; i < count; i++)
+    {
+        struct record *r = image_search(image, keys[i]);
+        sprintf(buf, "%d", i);
+        if (!r || strcmp(image_value(image, r), buf)) abort();
+    }
+    t = now(); printf("search  %8.1f ns/key\n", (t - start) * 1e9 / count); start = t;
+    for (int i = 0; i < count; i++) if (!search(tree, keys[i])) abort();
+    t = now(); printf("tree    %8.1f ns/key\n", (t - start) * 1e9 / count);
+
+    image_close(image);
+    unlink("bst.img");
+    destroy(&pool, tree);
+    free(keys);
+}
+#endif
+
+#ifdef CONCURRENT
+#include <stdint.h>
+#include <unistd.h>
+
+#define TKEYS 1000000
+static struct ctree ct = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static long long tkeys[TKEYS];
+static bool stop, locked;
+
+static void *reader(void *arg)
+{
+    unsigned long long x = (uintptr_t)arg * 0x9E3779B97F4A7C15ULL + 1, reads = 0;
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        if (locked)
+        {
+            pthread_mutex_lock(&ct.lock);
+            search(ct.root, tkeys[x % TKEYS]);
+            pthread_mutex_unlock(&ct.lock);
+        }
+        else csearch(&ct, tkeys[x % TKEYS], NULL, NULL);
+        reads++;
+    }
+    return (void *)(uintptr_t)reads;
+}
+
+static void *writer(void *arg)
+{
+    unsigned long long writes = 0;
+    (void)arg;
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    {
+        long long key = tkeys[rnd() % TKEYS];
+        cdelete(&ct, key, false);
+        cinsert(&ct, key, NULL, false);
+        writes += 2;
+        usleep(10);
+    }
+    return (void *)(uintptr_t)writes;
+}
+
+static void threads(int max)
+{
+    for (int i = 0; i < TKEYS; i++)
+    {
+        tkeys[i] = rnd() >> 1;
+        cinsert(&ct, tkeys[i], NULL, false);
+    }
+
+    printf("%7s %14s %14s %14s %14s\n", "readers", "mutex reads/s", "writes/s", "lockless r/s", "writes/s");
+    for (int count = 1; count <= max; count *= 2)
+    {
+        pthread_t tid[count + 1];
+        double rate[2][2];
+
+        for (int mode = 0; mode < 2; mode++)
+        {
+            unsigned long long reads = 0;
+            void *ret;
+            double start = now();
+
+            locked = !mode;
+            stop = false;
+            pthread_create(&tid[count], NULL, writer, NULL);
+            for (int i = 0; i < count; i++) pthread_create(&tid[i], NULL, reader, (void *)(uintptr_t)i);
+            sleep(1);
+            __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+            for (int i = 0; i < count; i++)
+            {
+                pthread_join(tid[i], &ret);
+                reads += (uintptr_t)ret;
+            }
+            pthread_join(tid[count], &ret);
+            rate[mode][0] = reads / (now() - start);
+            rate[mode][1] = (uintptr_t)ret / (now() - start);
+        }
+        printf("%7d %14.0f %14.0f %14.0f %14.0f\n", count, rate[0][0], rate[0][1], rate[1][0], rate[1][1]);
+    }
+    cdestroy(&ct);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+#ifdef CONCURRENT
+    if (argc > 1 && !strcmp(argv[1], "threads"))
+    {
+        threads((argc > 2) ? atoi(argv[2]) : 64);
+        return 0;
+    }
+#endif
+
+#ifdef IMAGE
+    if (argc > 1 && !strcmp(argv[1], "image"))
+    {
+        image((argc > 2) ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+#endif
+
+    if (argc > 1 && !strcmp(argv[1], "bulk"))
+    {
+        bulk((argc > 2) ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "sorted"))
+    {
+        sorted((argc > 2) ? atoi(argv[2]) : SORTED);
+        return 0;
+    }
+
+    int count = (argc > 1) ? atoi(argv[1]) : 1000000;
+    long long *keys = malloc(count * sizeof(long long));
+    struct pool pool = {0};
+    if (!keys) abort();
+
+#ifdef BALANCE
+    printf("%d keys, balanced\n", count);
+#else
+    printf("%d keys, unbalanced\n", count);
+#endif
+
+    for (int i = 0; i < count; i++) keys[i] = rnd() >> 1;
+    bench("malloc", NULL, keys, count);
+
+    for (int i = 0; i < count; i++) keys[i] = rnd() >> 1;
+    bench("pool", &pool, keys, count);
+
+    free(keys);
     return 0;
 }
 #endif
@@ -0,0 +1,235 @@
+// Open addressing hash map with the same semantics as bst.c: long long keys
+// map to malloced (or NULL) values which the map owns, and an optional
+// per-key counter. Use it when keys never need to be ordered.
+//
+// The layout follows Google's SwissTable. Each slot has a control byte which
+// is either EMPTY, DELETED, or 7 bits of the key's hash. Slots are probed a
+// group of 16 at a time, the control bytes of a group are compared with one
+// SSE2 instruction and only slots whose hash bits match are examined.
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define GROUP 16                // slots per group
+#define EMPTY ((signed char)0x80)
+#define DELETED ((signed char)0xFE)
+
+struct hmentry
+{
+    long long key;
+    void *value;
+    int counter;
+};
+
+struct hashmap
+{
+    signed char *ctrl;          // control byte per slot
+    struct hmentry *slot;
+    size_t size;                // number of slots, a power of 2 and a multiple of GROUP
+    size_t count;               // slots in use
+    size_t deleted;             // slots marked DELETED
+};
+
+// Return hash of key, the low bits select the group and the high 7 bits go
+// in the control byte
+static inline uint64_t hm_hash(long long key)
+{
+    uint64_t h = key;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Return bitmask of the control bytes in group which equal c
+static inline unsigned hm_match(signed char *group, signed char c)
+{
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((__m128i *)group), _mm_set1_epi8(c)));
+#else
+    unsigned mask = 0;
+    for (int i = 0; i < GROUP; i++) mask |= (unsigned)(group[i] == c) << i;
+    return mask;
+#endif
+}
+
+// Return the slot index of key, or -1 if not found
+static long hm_find(struct hashmap *m, long long key)
+{
+    uint64_t h = hm_hash(key);
+    size_t groups = m->size / GROUP, g = h & (groups - 1);
+
+    if (!m->size) return -1;
+    for (size_t probe = 1; ; g = (g + probe++) & (groups - 1))
+    {
+        signed char *group = m->ctrl + g * GROUP;
+        for (unsigned mask = hm_match(group, h >> 57); mask; mask &= mask - 1)
+        {
+            size_t i = g * GROUP + __builtin_ctz(mask);
+            if (m->slot[i].key == key) return i;
+        }
+        // keys are never placed past a group with an empty slot
+        if (hm_match(group, EMPTY) || probe > groups) return -1;
+    }
+}
+
+// Return the index of the first EMPTY or DELETED slot for key's hash
+static size_t hm_free(struct hashmap *m, uint64_t h)
+{
+    size_t groups = m->size / GROUP, g = h & (groups - 1);
+
+    for (size_t probe = 1; ; g = (g + probe++) & (groups - 1))
+    {
+        signed char *group = m->ctrl + g * GROUP;
+        unsigned mask = hm_match(group, EMPTY) | hm_match(group, DELETED);
+        if (mask) return g * GROUP + __builtin_ctz(mask);
+    }
+}
+
+// Resize the map to the specified number of slots and reinsert all keys
+static void hm_resize(struct hashmap *m, size_t size)
+{
+    struct hashmap old = *m;
+
+    m->ctrl = aligned_alloc(GROUP, size);
+    m->slot = malloc(size * sizeof(struct hmentry));
+    if (!m->ctrl || !m->slot) abort();
+    memset(m->ctrl, EMPTY, size);
+    m->size = size;
+    m->deleted = 0;
+
+    for (size_t i = 0; i < old.size; i++)
+    {
+        if (old.ctrl[i] < 0) continue; // EMPTY or DELETED
+        uint64_t h = hm_hash(old.slot[i].key);
+        size_t j = hm_free(m, h);
+        m->ctrl[j] = h >> 57;
+        m->slot[j] = old.slot[i];
+    }
+    free(old.ctrl);
+    free(old.slot);
+}
+
+// Insert key and value into map.
+// If key already exists, just replace the value.
+// Note *value must either be NULL or malloced.
+// If counting then increment counter if key exists.
+void hm_insert(struct hashmap *m, long long key, void *value, bool counting)
+{
+    long i = hm_find(m, key);
+    uint64_t h;
+
+    if (i >= 0)
+    {
+        if (m->slot[i].value) free(m->slot[i].value);
+        m->slot[i].value = value;
+        if (counting) m->slot[i].counter++;
+        return;
+    }
+
+    // keep load under 7/8, grow if over half live or else just flush deleted slots
+    if ((m->count + m->deleted + 1) * 8 > m->size * 7)
+        hm_resize(m, !m->size ? GROUP : (m->count * 2 > m->size) ? m->size * 2 : m->size);
+
+    h = hm_hash(key);
+    i = hm_free(m, h);
+    if (m->ctrl[i] == DELETED) m->deleted--;
+    m->ctrl[i] = h >> 57;
+    m->slot[i].key = key;
+    m->slot[i].value = value;
+    m->slot[i].counter = 1;
+    m->count++;
+}
+
+// Delete key from map if it exists. If counting, only delete when the counter
+// decrements to 0.
+void hm_delete(struct hashmap *m, long long key, bool counting)
+{
+    long i = hm_find(m, key);
+
+    if (i < 0) return;
+    if (counting && --m->slot[i].counter) return; // maybe just decrement the count to 0
+
+    if (m->slot[i].value) free(m->slot[i].value);
+    m->count--;
+
+    // If the group has an empty slot then it has never been full and no probe
+    // has passed it, so this slot can be empty too. Otherwise a probe may
+    // have to pass it.
+    if (hm_match(m->ctrl + (i & ~(GROUP - 1)), EMPTY)) m->ctrl[i] = EMPTY;
+    else
+    {
+        m->ctrl[i] = DELETED;
+        m->deleted++;
+    }
+}
+
+// Return entry containing specified key, or NULL
+struct hmentry *hm_search(struct hashmap *m, long long key)
+{
+    long i = hm_find(m, key);
+    return (i < 0) ? NULL : &m->slot[i];
+}
+
+// Free the map and all its values, and leave it empty
+void hm_destroy(struct hashmap *m)
+{
+    for (size_t i = 0; i < m->size; i++) if (m->ctrl[i] >= 0 && m->slot[i].value) free(m->slot[i].value);
+    free(m->ctrl);
+    free(m->slot);
+    memset(m, 0, sizeof(struct hashmap));
+}
+
+// To build the proof-of-concept: CFLAGS=-DPOC make -B hashmap
+// It performs random operations and checks the map against a flat array.
+// Define NOMAIN to #include this file into another program.
+#if defined(POC) && !defined(NOMAIN)
+#include <stdio.h>
+#include <assert.h>
+
+#define KEYS 20000
+int counter[KEYS];              // expected counter for each key, 0 if absent
+
+int main(void)
+{
+    struct hashmap m = {0};
+    size_t present = 0;
+
+    srand(1);
+    for (int i = 0; i < 2000000; i++)
+    {
+        // cycle between mostly inserting and mostly deleting
+        int key = rand() % KEYS, insert = rand() % 100 < ((i / 100000) & 1 ? 30 : 70);
+        bool counting = rand() & 1;
+        if (insert)
+        {
+            hm_insert(&m, key, (rand() & 1) ? malloc(1) : NULL, counting);
+            if (!counter[key]) counter[key] = 1, present++;
+            else if (counting) counter[key]++;
+        }
+        else
+        {
+            hm_delete(&m, key, counting);
+            if (counter[key] && (!counting || !--counter[key])) counter[key] = 0, present--;
+        }
+        struct hmentry *e = hm_search(&m, key);
+        assert(counter[key] ? e && e->counter == counter[key] : !e);
+        assert(m.count == present);
+    }
+    for (int key = 0; key < KEYS; key++)
+    {
+        struct hmentry *e = hm_search(&m, key);
+        assert(counter[key] ? e && e->counter == counter[key] : !e);
+    }
+
+    hm_destroy(&m);
+    printf("Seems to be working...\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,117 @@
+// Run identical workloads against the bst.c AVL tree, the bptree.c B+tree and
+// the hashmap.c hash map, to choose between them for a particular use.
+//
+// Build with: CFLAGS="-O3 -march=native" make mapbench
+// Then run "./mapbench [keys]", default one million.
+//
+// Each workload is timed in ns per operation:
+//   insert   insert random keys
+//   hit      search for keys that exist, in random order
+//   miss     search for keys that don't exist
+//   churn    delete a key and insert a new one
+//   count    insert with counting, with 16 copies of each key
+//   delete   delete all keys
+#define BALANCE
+#define NOMAIN
+#include "bst.c"
+#include "bptree.c"
+#include "hashmap.c"
+#include <stdio.h>
+#include <time.h>
+
+// xorshift64, good enough for benchmark keys
+static unsigned long long rnd(void)
+{
+    static unsigned long long x = 88172645463325252ULL;
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    return x;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long long *keys, *misses, *fresh;
+static int count;
+
+// Run the workloads given statements to insert, search, and delete key with
+// counting, and to reset the structure. Search evaluates true if key found.
+#define WORKLOAD(name, INSERT, SEARCH, DELETE, RESET) do                                    \
+{                                                                                           \
+    long long key; bool counting = false; double start = now(), t[6];                       \
+    for (int i = 0; i < count; i++) { key = keys[i]; INSERT; }                              \
+    t[0] = now();                                                                           \
+    for (int i = 0; i < count; i++) { key = keys[(i * 7919LL) % count]; if (!(SEARCH)) abort(); } \
+    t[1] = now();                                                                           \
+    for (int i = 0; i < count; i++) { key = misses[i]; if (SEARCH) abort(); }               \
+    t[2] = now();                                                                           \
+    for (int i = 0; i < count; i++)                                                         \
+    {                                                                                       \
+        key = keys[i]; DELETE;                                                              \
+        key = fresh[i]; INSERT;                                                             \
+    }                                                                                       \
+    t[3] = now();                                                                           \
+    RESET;                                                                                  \
+    counting = true;                                                                        \
+    for (int r = 0; r < 16; r++) for (int i = 0; i < count / 16; i++) { key = keys[i]; INSERT; } \
+    t[4] = now();                                                                           \
+    counting = false;                                                                       \
+    for (int i = 0; i < count / 16; i++) { key = keys[i]; DELETE; }                         \
+    t[5] = now();                                                                           \
+    RESET;                                                                                  \
+    printf("%-8s %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n", name,                              \
+           (t[0] - start) * 1e9 / count, (t[1] - t[0]) * 1e9 / count,                       \
+           (t[2] - t[1]) * 1e9 / count, (t[3] - t[2]) * 1e9 / count,                        \
+           (t[4] - t[3]) * 1e9 / count, (t[5] - t[4]) * 1e9 / (count / 16));                \
+} while (0)
+
+int main(int argc, char *argv[])
+{
+    count = (argc > 1) ? atoi(argv[1]) : 1000000;
+    if (count < 16) count = 16;
+    keys = malloc(count * sizeof(long long));
+    misses = malloc(count * sizeof(long long));
+    fresh = malloc(count * sizeof(long long));
+    if (!keys || !misses || !fresh) abort();
+
+    // keys are even, misses are odd, so they never collide
+    for (int i = 0; i < count; i++)
+    {
+        keys[i] = (rnd() >> 2) * 2;
+        misses[i] = (rnd() >> 2) * 2 + 1;
+        fresh[i] = (rnd() >> 2) * 2;
+    }
+
+    printf("%d keys, ns per operation\n", count);
+    printf("%-8s %8s %8s %8s %8s %8s %8s\n", "", "insert", "hit", "miss", "churn", "count", "delete");
+
+    struct pool pool = {0};
+    struct node *tree = NULL;
+    WORKLOAD("avl",
+             tree = insert(&pool, tree, key, NULL, counting),
+             search(tree, key),
+             tree = delete(&pool, tree, key, counting),
+             destroy(&pool, tree); tree = NULL);
+
+    struct bptree bp = {0};
+    WORKLOAD("b+tree",
+             bp_insert(&bp, key, NULL, counting),
+             bp_search(&bp, key),
+             bp_delete(&bp, key, counting),
+             bp_destroy(&bp));
+
+    struct hashmap hm = {0};
+    WORKLOAD("hashmap",
+             hm_insert(&hm, key, NULL, counting),
+             hm_search(&hm, key),
+             hm_delete(&hm, key, counting),
+             hm_destroy(&hm));
+
+    free(keys);
+    free(misses);
+    free(fresh);
+    return 0;
+}
@@ -1,14 +1,93 @@
 // Solve every possible mastermind game
+//
+// Usage: ./mm [-q] [-s strategy] [-t threads] [-c|-b]
+//
+// -q doesn't show the guesses, just the per-game stats.
+//
+// -s chooses the next guess, given the codes which are still possible, i.e.
+// which score the same against every prior guess as the goal did:
+//   first    - the first possible code after the prior guess, the default
+//   minimax  - the code which leaves the fewest possible codes in the worst
+//              case, as per Knuth
+//   expected - the code which leaves the fewest possible codes on average
+// minimax and expected consider every code but prefer possible codes, then the
+// lowest, if there's a tie.
+//
+// Each guess only depends on the scores of prior guesses, so the strategy is
+// planned once as a tree of guesses, by splitting the possible codes by their
+// score at each node. Then each game just follows the tree to its goal. minimax
+// and expected score every code against the possible codes at each node with
+// vscore(), which scores a guess against VLEN codes at once with GCC vector
+// extensions. For that the possible codes are copied a byte per peg and a byte
+// per color count, each in its own array. -c checks that vscore() agrees with
+// score() for every pair of codes, and -b times them.
+//
+// If built with THREADS (CFLAGS=-DTHREADS LDLIBS=-pthread make -B mm) then -t
+// splits the goals between threads. Each thread claims a block of goals at a
+// time and records the number of guesses for each, then the stats are reported
+// in goal order after all threads are done, so they're the same as a serial
+// run. The guesses for each game are shown as it's solved, in any order. While
+// planning, minimax and expected also split the guesses to score at each node
+// between threads, then pick the best in order, so the plan is the same too.
+//
+// Try e.g. CFLAGS="-O3 -DTHREADS -DPEGS=5 -DCOLORS=8" for a longer run.
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <unistd.h>
 
+#ifndef PEGS
 #define PEGS 4
+#endif
+#ifndef COLORS
 #define COLORS 8
+#endif
+
+#define SCORES ((PEGS+1)*(PEGS+1))  // scores are right*(PEGS+1)+wrong
+#define SOLVED (PEGS*(PEGS+1))      // all right
+#ifdef __AVX2__
+#define VLEN 32                     // codes scored at once by vscore()
+#else
+#define VLEN 16                     // SSE2 or NEON
+#endif
+
+// VLEN bytes, used unaligned
+typedef unsigned char vbytes __attribute__((vector_size(VLEN), aligned(1)));
+
+enum { FIRST, MINIMAX, EXPECTED };
+
+static int quiet;               // if set, don't show guesses
+static int strategy = FIRST;    // how to choose guesses
+static int threads = 1;         // threads to use
+static __thread int self;       // this thread's number, from 0
+static unsigned long codes;     // COLORS**PEGS
 
 typedef struct { unsigned char right, wrong, peg[PEGS]; } pegs;
 
+static pegs *code;              // every code, in order
+
+// Codes stored for vscore()
+struct set
+{
+    unsigned long count;        // number of codes
+    unsigned long stride;       // count rounded up to VLEN
+    unsigned char *pegat;       // pegat[i*stride+n] is peg i of code n
+    unsigned char *colors;      // colors[c*stride+n] is count of color c in code n
+};
+
+static struct set all;          // every code, in order
+
+// A node of the plan, with the code to guess and the nodes to go to after each
+// score, or NULL if that score is not possible
+struct node
+{
+    int guess;
+    struct node *next[SCORES];
+};
+
+static struct node *plan;
+
 // Score guess against target, setting guess's right and wrong
 static void score(pegs * const target, pegs *guess)
 {
@@ -36,71 +115,401 @@ static void score(pegs * const target, pegs *guess)
     guess->wrong -= guess->right;
 }
 
-// Advance pegs to next position, return true if wrapped
-static int inc(pegs *p)
+// Set pegs to the nth code, i.e. the nth count with peg[0] as the low digit
+static void nth(pegs *p, unsigned long n)
 {
     for (int i = 0; i < PEGS; i++)
     {
-        if (++p->peg[i] < COLORS) return 0;
-        p->peg[i] = 0;
+        p->peg[i] = n % COLORS;
+        n /= COLORS;
+    }
+}
+
+// Return the score of code guess against code target
+static int rate(int guess, int target)
+{
+    pegs g = code[guess];
+    score(&code[target], &g);
+    return g.right * (PEGS+1) + g.wrong;
+}
+
+// Set up set for vscore() with the count codes in list, or the first count
+// codes if list is NULL
+static void encode(struct set *set, int *list, unsigned long count)
+{
+    set->count = count;
+    set->stride = (count + VLEN - 1) / VLEN * VLEN;
+    set->pegat = calloc(PEGS * set->stride, 1);
+    set->colors = calloc(COLORS * set->stride, 1);
+    if (!set->pegat || !set->colors) abort();
+    for (unsigned long n = 0; n < count; n++)
+        for (int i = 0; i < PEGS; i++)
+        {
+            int peg = code[list ? list[n] : (int)n].peg[i];
+            set->pegat[i * set->stride + n] = peg;
+            set->colors[peg * set->stride + n]++;
+        }
+}
+
+// Free a set
+static void unencode(struct set *set)
+{
+    free(set->pegat);
+    free(set->colors);
+}
+
+// Set out[n] to the score of code guess against each code n of set, out must
+// have room for set->stride scores
+static void vscore(int guess, struct set *set, unsigned char *out)
+{
+    unsigned long stride = set->stride;
+    unsigned char gc[COLORS] = {0};
+
+    for (int i = 0; i < PEGS; i++) gc[code[guess].peg[i]]++;
+
+    for (unsigned long n = 0; n < stride; n += VLEN)
+    {
+        vbytes right = {0}, common = {0};
+
+        // equal is -1, so subtracting counts right pegs
+        for (int i = 0; i < PEGS; i++)
+            right -= (vbytes)(*(vbytes *)(set->pegat + i * stride + n) == code[guess].peg[i]);
+
+        // common colors are the sum of the lesser counts, only the guess's
+        // colors can add anything
+        for (int c = 0; c < COLORS; c++)
+            if (gc[c])
+            {
+                vbytes t = *(vbytes *)(set->colors + c * stride + n), more = (vbytes)(t > gc[c]);
+                common += (t & ~more) | (gc[c] & more);
+            }
+
+        // the wrong ones are common minus right
+        *(vbytes *)(out + n) = right * (PEGS+1) + common - right;
+    }
+}
+
+#ifdef THREADS
+#include <pthread.h>
+
+#define BLOCK 64                // items claimed by a thread at a time
+
+static struct
+{
+    unsigned long count;        // number of items
+    unsigned long next;         // next unclaimed item
+    void (*fn)(unsigned long);  // called for each item
+} job;
+
+// Do blocks of the job until there are none left, arg is the thread number
+static void *worker(void *arg)
+{
+    unsigned long first;
+    self = (intptr_t)arg;
+    while ((first = __atomic_fetch_add(&job.next, BLOCK, __ATOMIC_RELAXED)) < job.count)
+        for (unsigned long n = first; n < first + BLOCK && n < job.count; n++) job.fn(n);
+    return NULL;
+}
+#endif
+
+// Call fn(n) for each n from 0 to count-1, in any order
+static void each(unsigned long count, void (*fn)(unsigned long))
+{
+#ifdef THREADS
+    if (threads > 1)
+    {
+        pthread_t tid[threads];
+        job.count = count;
+        job.next = 0;
+        job.fn = fn;
+        for (int t = 0; t < threads; t++)
+            if (pthread_create(&tid[t], NULL, worker, (void *)(intptr_t)t)) abort();
+        for (int t = 0; t < threads; t++) pthread_join(tid[t], NULL);
+        return;
     }
-    return 1;
+#endif
+    for (unsigned long n = 0; n < count; n++) fn(n);
+}
+
+// The search for the next guess, shared by choose() and assess()
+static struct
+{
+    int n;                      // number of possible codes
+    struct set set;             // the possible codes
+    unsigned char *out;         // a vscore() buffer per thread
+    long *cost;                 // the cost of each guess
+    unsigned char *possible;    // set if the guess is a possible code
+} search;
+
+// Set the cost of guess g, i.e. the largest number of codes it leaves
+// possible, or the sum of the squares of the numbers
+static void assess(unsigned long g)
+{
+    unsigned char *out = search.out + self * search.set.stride;
+    int count[SCORES] = {0};
+    long cost = 0;
+
+    vscore(g, &search.set, out);
+    for (int i = 0; i < search.n; i++) count[out[i]]++;
+    for (int s = 0; s < SCORES; s++)
+        if (strategy == MINIMAX) { if (count[s] > cost) cost = count[s]; }
+        else cost += (long)count[s] * count[s];
+    search.cost[g] = cost;
+
+    // g is possible if it scores SOLVED against itself
+    search.possible[g] = count[SOLVED];
+}
+
+// Return the guess to make when the goal is one of the n possible codes, after
+// guessing prior
+static int choose(int *possible, int n, int prior)
+{
+    int best = 0;
+
+    if (strategy == FIRST)
+    {
+        // possible codes are in order
+        for (int i = 0; i < n; i++) if (possible[i] > prior) return possible[i];
+        return possible[0];
+    }
+
+    // With one or two codes left, either will do
+    if (n <= 2) return possible[0];
+
+    // score each guess against all the possible codes at once, on all threads
+    search.n = n;
+    encode(&search.set, possible, n);
+    search.out = malloc(threads * search.set.stride);
+    search.cost = malloc(codes * sizeof(long));
+    search.possible = malloc(codes);
+    if (!search.out || !search.cost || !search.possible) abort();
+    each(codes, assess);
+
+    // then take the cheapest, in order so the result doesn't depend on threads
+    for (unsigned long g = 1; g < codes; g++)
+        if (search.cost[g] < search.cost[best] || (search.cost[g] == search.cost[best] && search.possible[g] > search.possible[best]))
+            best = g;
+
+    unencode(&search.set);
+    free(search.out);
+    free(search.cost);
+    free(search.possible);
+    return best;
+}
+
+// Return the plan to find the goal among n possible codes, after guessing prior
+static struct node *build(int *possible, int n, int prior)
+{
+    struct node *node = calloc(1, sizeof(struct node));
+    int count[SCORES] = {0}, start[SCORES], *split = malloc(n * sizeof(int));
+
+    if (!node || !split) abort();
+    node->guess = choose(possible, n, prior);
+
+    // split the possible codes by their score, keeping them in order
+    for (int i = 0; i < n; i++) count[rate(node->guess, possible[i])]++;
+    for (int s = 0, sum = 0; s < SCORES; s++)
+    {
+        start[s] = sum;
+        sum += count[s];
+    }
+    for (int i = 0; i < n; i++) split[start[rate(node->guess, possible[i])]++] = possible[i];
+
+    for (int s = 0; s < SCORES; s++)
+        if (count[s] && s != SOLVED)
+            node->next[s] = build(split + start[s] - count[s], count[s], node->guess);
+
+    free(split);
+    return node;
+}
+
+// Free a plan
+static void unplan(struct node *node)
+{
+    if (!node) return;
+    for (int s = 0; s < SCORES; s++) unplan(node->next[s]);
+    free(node);
 }
 
 // Solve for goal and return total guesses
-static int solve(pegs *goal)
+static int solve(unsigned long goal)
 {
-    pegs prior[COLORS*PEGS];    // prior guesses
+    struct node *node = plan;
     int guesses=0;              // number of guesses
+    char show[(COLORS*PEGS + 1) * (PEGS*4 + 32)], *s = show; // shown all at once
 
     // show goal
-    printf("Goal:");
-    for (int i = 0; i < PEGS; i++) printf(" %d", goal->peg[i]);
-    printf("\n");
-
-    // Start with different colors
-    pegs guess;
-    for (int i = 0; i < PEGS; i++) guess.peg[i] = i % COLORS;
+    if (!quiet)
+    {
+        s += sprintf(s, "Goal:");
+        for (int i = 0; i < PEGS; i++) s += sprintf(s, " %d", code[goal].peg[i]);
+        s += sprintf(s, "\n");
+    }
 
     while(1)
     {
-        score(goal, &guess);        // score the guess against goal
-        prior[guesses++] = guess;   // and remember it
+        int r = rate(node->guess, goal);    // score the guess against goal
+        guesses++;
 
         // show guess
-        printf("     ");
-        for (int i = 0; i < PEGS; i++) printf(" %d", guess.peg[i]);
-        printf(", %d right and %d wrong\n", guess.right, guess.wrong);
-
-        if (guess.right == PEGS) break; // done!
-
-        // advance to next guess
-        next:
-        inc(&guess);
-        for (int i = 0; i < guesses; i++)
+        if (!quiet)
         {
-            // A valid guess has the same score against all prior guesses, as
-            // those guesses had against the goal
-            score(&prior[i], &guess);
-            if (guess.right != prior[i].right || guess.wrong != prior[i].wrong) goto next;
+            s += sprintf(s, "     ");
+            for (int i = 0; i < PEGS; i++) s += sprintf(s, " %d", code[node->guess].peg[i]);
+            s += sprintf(s, ", %d right and %d wrong\n", r / (PEGS+1), r % (PEGS+1));
         }
+
+        if (r == SOLVED) break; // done!
+
+        // the plan has the next guess for this score
+        node = node->next[r];
     }
 
+    if (!quiet) fputs(show, stdout);
     return guesses;
 }
 
-int main(void)
+// Report stats after another game
+static void report(int guesses)
 {
-    int games = 0, total = 0, most = 0;       // stats
-    pegs goal = {0};                          // iterate all possible goals
-    do
+    static int games = 0, total = 0, most = 0;
+    if (guesses > most) most = guesses;
+    total += guesses;
+    games++;
+    printf("Game %d solved in %d guesses, %d most, %d total, %f average\n", games, guesses, most, total, (float)total/games);
+}
+
+static unsigned char *results;  // guesses per goal
+
+// Solve goal n and record the guesses
+static void game(unsigned long n)
+{
+    results[n] = solve(n);
+}
+
+// Check that vscore() agrees with score() for every pair of codes, return 0
+// if so
+static int check(void)
+{
+    unsigned char *out = malloc(all.stride);
+
+    if (!out) abort();
+    for (unsigned long g = 0; g < codes; g++)
     {
-        int guesses = solve(&goal);
-        if (guesses > most) most = guesses;
-        total += guesses;
-        games++;
-        printf("Game %d solved in %d guesses, %d most, %d total, %f average\n", games, guesses, most, total, (float)total/games);
-    } while (!inc(&goal));
+        vscore(g, &all, out);
+        for (unsigned long t = 0; t < codes; t++)
+            if (out[t] != rate(g, t))
+            {
+                printf("Guess %lu against %lu, score() says %d but vscore() says %d\n", g, t, rate(g, t), out[t]);
+                free(out);
+                return 1;
+            }
+    }
+    printf("vscore() agrees with score() for all %lu pairs\n", codes * codes);
+    free(out);
+    return 0;
+}
+
+#include <time.h>
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Time score() and vscore() on every pair of codes
+static void bench(void)
+{
+    unsigned char *out = malloc(all.stride);
+    unsigned long sum[2] = {0};
+    double start, t[2];
+
+    if (!out) abort();
+    start = now();
+    for (unsigned long g = 0; g < codes; g++)
+        for (unsigned long n = 0; n < codes; n++) sum[0] += rate(g, n);
+    t[0] = now() - start;
+
+    start = now();
+    for (unsigned long g = 0; g < codes; g++)
+    {
+        vscore(g, &all, out);
+        for (unsigned long n = 0; n < codes; n++) sum[1] += out[n];
+    }
+    t[1] = now() - start;
+    free(out);
+
+    if (sum[0] != sum[1]) abort();
+    printf("%lu pairs, ns per pair: score() %.2f, vscore() %.2f, %.1fx faster\n",
+           codes * codes, t[0] * 1e9 / (codes * codes), t[1] * 1e9 / (codes * codes), t[0] / t[1]);
+}
+
+int main(int argc, char *argv[])
+{
+    char *strategies[] = {"first", "minimax", "expected"};
+    unsigned long start = 0;
+    int opt, *possible, test = 0;
+
+    while ((opt = getopt(argc, argv, "qs:t:cb")) != -1)
+        switch (opt)
+        {
+            case 'q': quiet = 1; break;
+            case 't': threads = atoi(optarg); break;
+            case 'c': case 'b': test = opt; break;
+            case 's':
+                for (strategy = 2; strategy >= 0 && strcmp(optarg, strategies[strategy]); strategy--);
+                if (strategy >= 0) break;
+                // fall through
+            default: fprintf(stderr, "Usage: %s [-q] [-s first|minimax|expected] [-t threads] [-c|-b]\n", argv[0]); return 1;
+        }
+
+    if (threads < 1) threads = 1;
+#ifndef THREADS
+    if (threads > 1) fprintf(stderr, "Not built with THREADS, ignoring -t\n");
+    threads = 1;
+#endif
+
+    codes = 1;
+    for (int i = 0; i < PEGS; i++) codes *= COLORS;
+    code = malloc(codes * sizeof(pegs));
+    possible = malloc(codes * sizeof(int));
+    if (!code || !possible) abort();
+    for (unsigned long n = 0; n < codes; n++)
+    {
+        nth(&code[n], n);
+        possible[n] = n;
+    }
+    encode(&all, NULL, codes);
+
+    if (test)
+    {
+        if (test == 'c') opt = check(); else bench();
+        free(possible);
+        free(code);
+        unencode(&all);
+        return test == 'c' && opt;
+    }
+
+    // first starts with different colors
+    for (int i = PEGS - 1; i >= 0; i--) start = start * COLORS + i % COLORS;
+    plan = build(possible, codes, (int)start - 1);
+    free(possible);
+
+    if (threads > 1)
+    {
+        results = malloc(codes);
+        if (!results) abort();
+        each(codes, game);
+        for (unsigned long n = 0; n < codes; n++) report(results[n]);
+        free(results);
+    }
+    else
+        for (unsigned long n = 0; n < codes; n++) report(solve(n));
 
+    unplan(plan);
+    free(code);
+    unencode(&all);
     return 0;
 }
@@ -1,13 +1,29 @@
+// Primality testing and factoring for 64-bit numbers.
+//
+// Usage:
+//   ./prime [n]                        - show the isqrt, first factor and all
+//                                        factors of n
+//   ./prime -b [-t threads] < numbers  - read numbers from stdin and print
+//                                        "n: factors" for each
+//
+// If built with THREADS (CFLAGS=-DTHREADS LDLIBS=-pthread make -B prime) then
+// -t splits each batch of BATCH numbers between 1 to MAXTHREADS threads, the
+// results are still printed in input order.
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+typedef unsigned __int128 uint128_t;
 
 // Return integer square root of n.
-unsigned int isqrt(unsigned int n)
+uint64_t isqrt(uint64_t n)
 {
-    unsigned int root = 0;
-    for (unsigned int pow4 = 1 << 30; pow4; pow4 >>= 2)
+    uint64_t root = 0;
+    for (uint64_t pow4 = 1ULL << 62; pow4; pow4 >>= 2)
     {
-        unsigned int limit = root + pow4;
+        uint64_t limit = root + pow4;
         root >>= 1;
         if (n >= limit)
         {
@@ -18,32 +34,321 @@ unsigned int isqrt(unsigned int n)
     return root;
 }
 
-// Test if n is prime. If so return n, otherwise return the first identified
-// factor of n (which may not be the smallest factor).
-// Since all primes greater than 3 are in the form 6k +/- 1, we only test those
-// potential factors, up to the square root of n.
-// For the worst case n = 429467291 this algorithm will perform 21846 divisions
-// looking for a factor.
-unsigned int prime(unsigned int n)
+// Arithmetic mod odd n in Montgomery form, i.e. x is represented by x*2^64 mod
+// n, so multiplication needs no division.
+struct mont
+{
+    uint64_t n;                 // modulus
+    uint64_t inv;               // 1/n mod 2^64
+    uint64_t one;               // 1 in Montgomery form
+};
+
+static void mont_init(struct mont *m, uint64_t n)
 {
+    m->n = n;
+    m->inv = n;                 // correct to 3 bits, each step doubles that
+    for (int i = 0; i < 5; i++) m->inv *= 2 - n * m->inv;
+    m->one = -n % n;
+}
+
+// Return x/2^64 mod n, x must be less than n*2^64
+static inline uint64_t mont_reduce(struct mont *m, uint128_t x)
+{
+    uint64_t hi = x >> 64, q = ((uint128_t)((uint64_t)x * m->inv) * m->n) >> 64;
+    return hi >= q ? hi - q : hi - q + m->n;
+}
+
+static inline uint64_t mont_mul(struct mont *m, uint64_t a, uint64_t b)
+{
+    return mont_reduce(m, (uint128_t)a * b);
+}
+
+// Convert x to Montgomery form
+static inline uint64_t mont_to(struct mont *m, uint64_t x)
+{
+    return ((uint128_t)x << 64) % m->n;
+}
+
+// Return true if odd n > 37 is a strong probable prime to base a
+static int sprp(struct mont *m, uint64_t a)
+{
+    uint64_t d = m->n - 1, x = m->one, minus = m->n - m->one;
+    int s = __builtin_ctzll(d);
+
+    a = mont_to(m, a % m->n);
+    if (!a) return 1;
+
+    // x = a**d
+    for (d >>= s; d; d >>= 1, a = mont_mul(m, a, a)) if (d & 1) x = mont_mul(m, x, a);
+    if (x == m->one || x == minus) return 1;
+    while (--s)
+    {
+        x = mont_mul(m, x, x);
+        if (x == minus) return 1;
+        if (x == m->one) return 0;
+    }
+    return 0;
+}
+
+// Return true if odd n > 37 is prime. These seven bases are known to have no
+// strong pseudoprimes below 2^64.
+static int miller_rabin(uint64_t n)
+{
+    static const uint64_t bases[] = {2, 325, 9375, 28178, 450775, 9780504, 1795265022};
+    struct mont m;
+
+    mont_init(&m, n);
+    for (int i = 0; i < 7; i++) if (!sprp(&m, bases[i])) return 0;
+    return 1;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b)
+{
+    while (b)
+    {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Return (v*v + c) mod n, for rho()
+static inline uint64_t rho_step(struct mont *m, uint64_t v, uint64_t c)
+{
+    uint64_t s = mont_mul(m, v, v) + c;
+    return (s >= m->n || s < c) ? s - m->n : s;
+}
+
+// Return the difference of a and b
+static inline uint64_t rho_diff(uint64_t a, uint64_t b)
+{
+    return a > b ? a - b : b - a;
+}
+
+// Return a factor of odd composite n, which may not be prime, with Brent's
+// variant of Pollard's rho. The gcd is only taken every 128 steps, of the
+// product of the differences.
+static uint64_t rho(uint64_t n)
+{
+    struct mont m;
+
+    mont_init(&m, n);
+    for (uint64_t c = 1;; c++)
+    {
+        uint64_t x = 0, y = mont_to(&m, 2), ys = y, q = m.one, g = 1, r = 1;
+
+        do
+        {
+            x = y;
+            for (uint64_t i = 0; i < r; i++) y = rho_step(&m, y, c);
+            for (uint64_t k = 0; k < r && g == 1; k += 128)
+            {
+                ys = y;
+                for (uint64_t i = 0; i < 128 && i < r - k; i++)
+                {
+                    y = rho_step(&m, y, c);
+                    q = mont_mul(&m, q, rho_diff(x, y));
+                }
+                g = gcd(q, n);
+            }
+            r *= 2;
+        } while (g == 1);
+
+        // if the product hit 0 then back up and go one step at a time
+        if (g == n)
+            do
+            {
+                ys = rho_step(&m, ys, c);
+                g = gcd(rho_diff(x, ys), n);
+            } while (g == 1);
+
+        if (g != n) return g;   // otherwise try another c
+    }
+}
+
+// Test if n is prime. If so return n, otherwise return a prime factor of n
+// (which may not be the smallest factor).
+// Since all primes greater than 3 are in the form 6k +/- 1, only those are
+// tried as small factors, up to 1000. Larger n are tested with Miller-Rabin,
+// and factored with Pollard's rho.
+uint64_t prime(uint64_t n)
+{
+    uint64_t f;
+
     if (n <= 3) return n;
     if (!(n % 2)) return 2;
     if (!(n % 3)) return 3;
 
-    unsigned int max = isqrt(n) + 1;
-    for (unsigned int d = 5, o = 2;  d <= max; d += o, o = 6 - o) if (!(n % d)) return d;
-    return n;
+    for (uint64_t d = 5, o = 2; d <= 1000; d += o, o = 6 - o)
+    {
+        if (d * d > n) return n;
+        if (!(n % d)) return d;
+    }
+    if (miller_rabin(n)) return n;
+
+    f = rho(n);
+    return prime(f < n / f ? f : n / f);
 }
 
 #define isprime(n) (prime(n) == (n))
 
-int main(int argc, char *argv[])
+// Put the prime factors of n in f[], smallest first, and return how many there
+// are, up to 64. 0 and 1 have none.
+int factor(uint64_t n, uint64_t f[64])
 {
-    unsigned int n = (argc > 1) ? atoi(argv[1]) : 4294967291; // default use the worst case
-    unsigned int f = prime(n);
+    int count = 0;
 
-    printf("isqrt(%u) = %u\n", n, isqrt(n));
-    printf("First factor of %u is %u\n", n, f);
-    printf("%u %s prime\n", n, (n == f) ? "is" : "is not");
+    while (n > 1)
+    {
+        uint64_t p = prime(n);
+        do
+        {
+            int i = count++;
+            for (; i && f[i-1] > p; i--) f[i] = f[i-1];
+            f[i] = p;
+            n /= p;
+        } while (!(n % p));
+    }
+    return count;
+}
+
+// Define NOMAIN to #include this file into another program.
+#ifndef NOMAIN
+#define BATCH 65536             // numbers factored at a time
+#define LINE 192                // longest "n: factors" line, with room to spare
+
+struct batch
+{
+    uint64_t *n;                // numbers
+    char *out;                  // their factors
+    size_t count;
+};
+
+// Print "n: factors" for each number in the batch to its out
+static void *batch(void *arg)
+{
+    struct batch *b = arg;
+    char *o = b->out = malloc(b->count * LINE + 1);
+
+    if (!o) abort();
+    for (size_t i = 0; i < b->count; i++)
+    {
+        uint64_t f[64];
+        int count = factor(b->n[i], f);
+        o += sprintf(o, "%llu:", (unsigned long long)b->n[i]);
+        for (int j = 0; j < count; j++) o += sprintf(o, " %llu", (unsigned long long)f[j]);
+        *o++ = '\n';
+    }
+    *o = 0;
+    return NULL;
+}
+
+// Set *n to the decimal number in word and return 0, or report it and return
+// -1 if it isn't a number from 0 to 2^64-1
+static int parse(char *word, uint64_t *n)
+{
+    char *end;
+
+    errno = 0;
+    *n = strtoull(word, &end, 10);
+    if (*word < '0' || *word > '9' || *end || errno)
+    {
+        fprintf(stderr, "Invalid number '%s'\n", word);
+        return -1;
+    }
     return 0;
 }
+
+// Read the next number from stdin to *n and return 1, or return 0 at the end,
+// or -1 if the next word isn't a number
+static int next(uint64_t *n)
+{
+    char word[32];
+    int c;
+
+    if (scanf("%31s", word) != 1) return 0;
+    if ((c = getchar()) != EOF && c != ' ' && c != '\n' && c != '\t' && c != '\r')
+    {
+        fprintf(stderr, "Invalid number '%s...'\n", word);
+        return -1;
+    }
+    return parse(word, n) ? -1 : 1;
+}
+
+#ifdef THREADS
+#include <pthread.h>
+#endif
+
+// -t limit, the batch and thread arrays live on the stack
+#define MAXTHREADS 256
+
+int main(int argc, char *argv[])
+{
+    int opt, batchmode = 0, threads = 1, status = 1;
+
+    while ((opt = getopt(argc, argv, "bt:")) != -1)
+        switch (opt)
+        {
+            case 'b': batchmode = 1; break;
+            case 't': threads = atoi(optarg); if (threads >= 1 && threads <= MAXTHREADS) break; // else fall through
+            default: fprintf(stderr, "Usage: %s [n] | -b [-t threads] < numbers\nWhere threads is 1 to %d\n", argv[0], MAXTHREADS); return 1;
+        }
+#ifndef THREADS
+    if (threads > 1) fprintf(stderr, "Not built with THREADS, ignoring -t\n");
+    threads = 1;
+#endif
+
+    if (!batchmode)
+    {
+        uint64_t n = 18446744073709551557ULL, p, f[64]; // default is the largest 64-bit prime
+        int count;
+
+        if (optind < argc && parse(argv[optind], &n)) return 1;
+        p = prime(n);
+        count = factor(n, f);
+        printf("isqrt(%llu) = %llu\n", (unsigned long long)n, (unsigned long long)isqrt(n));
+        printf("First factor of %llu is %llu\n", (unsigned long long)n, (unsigned long long)p);
+        printf("%llu %s prime\n", (unsigned long long)n, (n == p) ? "is" : "is not");
+        printf("Factors:");
+        for (int i = 0; i < count; i++) printf(" %llu", (unsigned long long)f[i]);
+        printf("\n");
+        return 0;
+    }
+
+    // stop at the end of input or at the first word which isn't a number, and
+    // return non-zero for the latter
+    uint64_t *n = malloc(BATCH * sizeof(uint64_t));
+    struct batch b[threads];
+    if (!n) abort();
+    while (status > 0)
+    {
+        size_t count = 0;
+        while (count < BATCH && (status = next(&n[count])) > 0) count++;
+        if (!count) break;
+
+        // split the batch between threads, then print in order
+        for (int t = 0; t < threads; t++)
+        {
+            b[t].n = n + count * t / threads;
+            b[t].count = count * (t + 1) / threads - count * t / threads;
+        }
+#ifdef THREADS
+        pthread_t tid[threads];
+        for (int t = 1; t < threads; t++)
+            if (pthread_create(&tid[t], NULL, batch, &b[t])) abort();
+        batch(&b[0]);
+        for (int t = 1; t < threads; t++) pthread_join(tid[t], NULL);
+#else
+        batch(&b[0]);
+#endif
+        for (int t = 0; t < threads; t++)
+        {
+            fputs(b[t].out, stdout);
+            free(b[t].out);
+        }
+    }
+    free(n);
+    return status < 0;
+}
+#endif
@@ -0,0 +1,266 @@
+// Parallel sort, a sample sort on top of qs.c. A random sample of the input is
+// sorted to choose splitters which divide values into buckets, values equal to
+// a splitter get a bucket of their own so duplicate-heavy input still splits
+// evenly and those buckets need no sorting. Then each
+// thread counts how many elements of its share of the input fall in each
+// bucket, then copies them to their bucket in a temporary array, then the
+// threads take turns sorting buckets with qs.c and copying them back. All
+// passes run on every thread so it scales with cores until memory bandwidth
+// runs out. Arrays with less than PSORT_MIN elements are just sorted with
+// qs.c. Link with -pthread.
+//
+// Sorts ints by default, define PTYPE and PLESS(x, y) before including this
+// file to sort another type.
+#ifdef NOMAIN
+#include "qs.c"
+#else
+#define NOMAIN
+#include "qs.c"
+#undef NOMAIN
+#endif
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef PTYPE
+#define PTYPE int
+#define PLESS(x, y) ((x) < (y))
+#endif
+
+#define PSORT_MIN 65536         // sort serially below this
+#define BUCKETS 4               // splitters per thread, roughly
+#define SAMPLES 64              // samples per splitter
+
+QSORT(psort_serial, PTYPE, PLESS(x, y))
+
+struct psort
+{
+    PTYPE *a, *tmp;
+    PTYPE *splitter;            // distinct, ascending
+    size_t n;
+    size_t *count;              // elements per thread per bucket, then where they go
+    size_t *start;              // first element of each bucket
+    int threads, splitters;
+    int buckets;                // 2 * splitters + 1
+    int next;                   // next bucket to sort
+};
+
+struct psort_job
+{
+    struct psort *s;
+    int thread;
+};
+
+// Return the bucket for x. Bucket 2*i+1 holds values equal to splitter i, and
+// bucket 2*i the values between splitter i-1 and splitter i.
+static int psort_bucket(struct psort *s, PTYPE x)
+{
+    int lo = 0, hi = s->splitters;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (PLESS(x, s->splitter[mid])) hi = mid; else lo = mid + 1;
+    }
+    // lo is the first splitter greater than x
+    return (lo && !PLESS(s->splitter[lo-1], x)) ? 2 * lo - 1 : 2 * lo;
+}
+
+// Count the elements of this thread's share in each bucket
+static void *psort_count(void *arg)
+{
+    struct psort_job *j = arg;
+    struct psort *s = j->s;
+    size_t *count = s->count + j->thread * s->buckets;
+
+    for (size_t i = s->n * j->thread / s->threads; i < s->n * (j->thread + 1) / s->threads; i++)
+        count[psort_bucket(s, s->a[i])]++;
+    return NULL;
+}
+
+// Copy the elements of this thread's share to their buckets
+static void *psort_scatter(void *arg)
+{
+    struct psort_job *j = arg;
+    struct psort *s = j->s;
+    size_t *count = s->count + j->thread * s->buckets;
+
+    for (size_t i = s->n * j->thread / s->threads; i < s->n * (j->thread + 1) / s->threads; i++)
+        s->tmp[count[psort_bucket(s, s->a[i])]++] = s->a[i];
+    return NULL;
+}
+
+// Sort buckets and copy them back until there are none left
+static void *psort_buckets(void *arg)
+{
+    struct psort *s = ((struct psort_job *)arg)->s;
+    int b;
+
+    while ((b = __atomic_fetch_add(&s->next, 1, __ATOMIC_RELAXED)) < s->buckets)
+    {
+        size_t start = s->start[b], length = s->start[b+1] - start;
+        if (!(b & 1)) psort_serial(s->tmp + start, length);
+        memcpy(s->a + start, s->tmp + start, length * sizeof(PTYPE));
+    }
+    return NULL;
+}
+
+// Run fn on all threads and wait for them to finish, the caller is thread 0
+static void psort_run(struct psort *s, void *(*fn)(void *))
+{
+    pthread_t tid[s->threads];
+    struct psort_job job[s->threads];
+
+    for (int t = 0; t < s->threads; t++)
+    {
+        job[t] = (struct psort_job){s, t};
+        if (t && pthread_create(&tid[t], NULL, fn, &job[t])) abort();
+    }
+    fn(&job[0]);
+    for (int t = 1; t < s->threads; t++) pthread_join(tid[t], NULL);
+}
+
+// Sort n elements of a in place using the specified number of threads
+void psort(PTYPE *a, size_t n, int threads)
+{
+    struct psort s = {.a = a, .n = n, .threads = threads};
+    size_t samples = threads * BUCKETS * SAMPLES, sum = 0;
+    unsigned long long x = 88172645463325252ULL;
+
+    if (threads < 2 || n < PSORT_MIN)
+    {
+        psort_serial(a, n);
+        return;
+    }
+
+    s.tmp = malloc(n * sizeof(PTYPE));
+    s.splitter = malloc(samples * sizeof(PTYPE));
+    s.count = calloc(threads * (2 * threads * BUCKETS - 1), sizeof(size_t));
+    s.start = malloc(2 * threads * BUCKETS * sizeof(size_t));
+    if (!s.tmp || !s.splitter || !s.count || !s.start) abort();
+
+    // sort a random sample and take every SAMPLES'th as a splitter, skipping
+    // repeats
+    for (size_t i = 0; i < samples; i++)
+    {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        s.splitter[i] = a[x % n];
+    }
+    psort_serial(s.splitter, samples);
+    for (int i = 1; i < threads * BUCKETS; i++)
+        if (!s.splitters || PLESS(s.splitter[s.splitters-1], s.splitter[i * SAMPLES]))
+            s.splitter[s.splitters++] = s.splitter[i * SAMPLES];
+    s.buckets = 2 * s.splitters + 1;
+
+    psort_run(&s, psort_count);
+
+    // turn counts into offsets, each thread's elements of a bucket follow the
+    // previous thread's
+    for (int b = 0; b < s.buckets; b++)
+    {
+        s.start[b] = sum;
+        for (int t = 0; t < threads; t++)
+        {
+            size_t count = s.count[t * s.buckets + b];
+            s.count[t * s.buckets + b] = sum;
+            sum += count;
+        }
+    }
+    s.start[s.buckets] = n;
+
+    psort_run(&s, psort_scatter);
+    psort_run(&s, psort_buckets);
+
+    free(s.tmp);
+    free(s.splitter);
+    free(s.count);
+    free(s.start);
+}
+
+// Define NOMAIN to #include this file into another program.
+// To build the proof-of-concept: CFLAGS=-DPOC LDLIBS=-pthread make -B psort
+// It sorts random arrays of various sizes and value ranges with 1 to 16
+// threads and checks the result against qs().
+#if defined(POC) && !defined(NOMAIN)
+#include <stdio.h>
+#include <assert.h>
+
+int main(void)
+{
+    srand(1);
+    for (int i = 0; i < 100; i++)
+    {
+        int ranges[] = {RAND_MAX, 10, 1000, 1};
+        int n = (i & 1) ? rand() % 1000000 : rand() % 1000, range = ranges[i / 2 % 4];
+        int *a = malloc(n * sizeof(int) + 1), *b = malloc(n * sizeof(int) + 1);
+        assert(a && b);
+        for (int j = 0; j < n; j++) a[j] = b[j] = rand() % range;
+        psort(a, n, 1 + i % 16);
+        qs(b, b + n - 1);
+        assert(!memcmp(a, b, n * sizeof(int)));
+        free(a);
+        free(b);
+    }
+    printf("Seems to be working...\n");
+    return 0;
+}
+#endif
+
+// To build the benchmark: CFLAGS="-O3 -DBENCH" LDLIBS=-pthread make -B psort
+// Then run "./psort [count [threads]]", default 10 million ints and 1 to 64
+// threads. For random ints, ints with only 16 distinct values, and ints which
+// are mostly zero, it reports the time for qs() and for psort() with each
+// power of 2 threads, and the speedup over qs().
+#if defined(BENCH) && !defined(NOMAIN)
+#include <stdio.h>
+#include <time.h>
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t count = (argc > 1) ? strtoull(argv[1], NULL, 0) : 10000000;
+    int max = (argc > 2) ? atoi(argv[2]) : 64;
+    int *input = malloc(count * sizeof(int)), *expect = malloc(count * sizeof(int)), *v = malloc(count * sizeof(int));
+    unsigned long long x = 88172645463325252ULL;
+    char *name[] = {"random", "16 values", "90% zero"};
+
+    if (!input || !expect || !v) abort();
+    printf("%zu ints\n", count);
+    for (int kind = 0; kind < 3; kind++)
+    {
+        double start, serial;
+        for (size_t i = 0; i < count; i++)
+        {
+            x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+            input[i] = (kind == 0) ? (int)x : (kind == 1) ? (int)(x % 16) : (x % 10) ? 0 : (int)(x >> 8);
+        }
+
+        memcpy(expect, input, count * sizeof(int));
+        start = now();
+        qs(expect, expect + count - 1);
+        serial = now() - start;
+        printf("\n%s\n%7s %9s %8s\n", name[kind], "threads", "mS", "speedup");
+        printf("%7s %9.1f %8.2f\n", "qs", serial * 1e3, 1.0);
+
+        for (int threads = 1; threads <= max; threads *= 2)
+        {
+            double t;
+            memcpy(v, input, count * sizeof(int));
+            start = now();
+            psort(v, count, threads);
+            t = now() - start;
+            if (memcmp(v, expect, count * sizeof(int))) abort();
+            printf("%7d %9.1f %8.2f\n", threads, t * 1e3, serial / t);
+        }
+    }
+    free(input);
+    free(expect);
+    free(v);
+    return 0;
+}
+#endif
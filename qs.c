@@ -1,10 +1,160 @@
-// Quick sort, requires around log2(n)*6 words of free stack, where 'n' is the
-// number of elements to sort and 'word' is sizeof(void *). This generally
-// rules out embedded systems, in that case use bubble sort.
+// Quick sort, actually introsort. The pivot is the median of three elements,
+// or the median of three medians for large arrays, the smaller partition is
+// sorted recursively and the larger one iteratively so recursion is at most
+// log2(n) deep, small partitions are finished with a sorting network from
+// bs.c, and if partitioning goes badly then heap sort takes over so the worst
+// case is O(n*log(n)). Recursion needs around log2(n)*8 words of stack, where
+// 'n' is the number of elements to sort and 'word' is sizeof(void *). This
+// may still rule out embedded systems, in that case use bubble sort.
+#include <stddef.h>
 
-// Given two pointers into a contiguous array of ints, recursively sort the
-// elements between the pointers.
+// bs.c provides SNET()
+#ifdef NOMAIN
+#include "bs.c"
+#else
+#define NOMAIN
+#include "bs.c"
+#undef NOMAIN
+#endif
+
+#define QSORT_SMALL 16          // sorting network for partitions up to this size
+#define QSORT_NINTHER 128       // use median of medians above this size
+
+// Define function "void name(type *a, size_t n)" to sort n elements of the
+// specified type in place. LESS is an expression of elements x and y which is
+// true if x sorts before y, for example:
+//   QSORT(sort_doubles, double, x < y)
+//   QSORT(sort_strings, char *, strcmp(x, y) < 0)
+//   QSORT(sort_points, struct point, x.y < y.y || (x.y == y.y && x.x < y.x))
+#define QSORT(name, type, LESS)                                                 \
+static inline int name##_less(type x, type y) { return LESS; }                  \
+                                                                                \
+SNET(name##_small, type, LESS)                                                  \
+                                                                                \
+static void name##_sift(type *a, size_t root, size_t n)                         \
+{                                                                               \
+    type x = a[root];                                                           \
+    for (size_t child; (child = 2 * root + 1) < n; root = child)                \
+    {                                                                           \
+        if (child + 1 < n && name##_less(a[child], a[child+1])) child++;        \
+        if (!name##_less(x, a[child])) break;                                   \
+        a[root] = a[child];                                                     \
+    }                                                                           \
+    a[root] = x;                                                                \
+}                                                                               \
+                                                                                \
+static void name##_heap(type *a, size_t n)                                      \
+{                                                                               \
+    for (size_t i = n / 2; i--;) name##_sift(a, i, n);                          \
+    while (n > 1)                                                               \
+    {                                                                           \
+        type x = a[0]; a[0] = a[--n]; a[n] = x;                                 \
+        name##_sift(a, 0, n);                                                   \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+/* return index of the median of a[i], a[j] and a[k] */                         \
+static size_t name##_median(type *a, size_t i, size_t j, size_t k)              \
+{                                                                               \
+    if (name##_less(a[i], a[j]))                                                \
+        return name##_less(a[j], a[k]) ? j : name##_less(a[i], a[k]) ? k : i;   \
+    return name##_less(a[k], a[j]) ? j : name##_less(a[k], a[i]) ? k : i;       \
+}                                                                               \
+                                                                                \
+static void name##_intro(type *a, size_t n, int depth)                          \
+{                                                                               \
+    while (n > QSORT_SMALL)                                                     \
+    {                                                                           \
+        size_t mid = n / 2, m, s = n / 8, left;                                 \
+        type p;                                                                 \
+        type *f = a;                                                            \
+        type *l = a + n - 1;                                                    \
+                                                                                \
+        if (!depth--)                                                           \
+        {                                                                       \
+            name##_heap(a, n);                                                  \
+            return;                                                             \
+        }                                                                       \
+        if (n > QSORT_NINTHER)                                                  \
+            m = name##_median(a, name##_median(a, 0, s, 2 * s),                 \
+                                 name##_median(a, mid - s, mid, mid + s),       \
+                                 name##_median(a, n - 1 - 2 * s, n - 1 - s, n - 1)); \
+        else m = name##_median(a, 0, mid, n - 1);                               \
+                                                                                \
+        /* The pivot goes in the middle so neither partition can be empty */    \
+        p = a[m]; a[m] = a[mid]; a[mid] = p;                                    \
+        while (1)                                                               \
+        {                                                                       \
+            while (name##_less(*f, p)) f++;                                     \
+            while (name##_less(p, *l)) l--;                                     \
+            if (f >= l) break;                                                  \
+            type x = *f; *f++ = *l; *l-- = x;                                   \
+        }                                                                       \
+                                                                                \
+        left = l - a + 1;                                                       \
+        if (left < n - left)                                                    \
+        {                                                                       \
+            name##_intro(a, left, depth);                                       \
+            a += left;                                                          \
+            n -= left;                                                          \
+        }                                                                       \
+        else                                                                    \
+        {                                                                       \
+            name##_intro(a + left, n - left, depth);                            \
+            n = left;                                                           \
+        }                                                                       \
+    }                                                                           \
+    name##_small(a, n);                                                         \
+}                                                                               \
+                                                                                \
+static void name(type *a, size_t n)                                             \
+{                                                                               \
+    name##_intro(a, n, 2 * (64 - __builtin_clzll(n | 1)));                      \
+}
+
+QSORT(qs_int, int, x < y)
+
+// Given two pointers into a contiguous array of ints, sort the elements
+// between the pointers, inclusive.
 static void qs(int *first, int *last)
+{
+    if (first < last) qs_int(first, last - first + 1);
+}
+
+// Define NOMAIN to #include this file into another program.
+#if defined(BENCH) && !defined(NOMAIN)
+// To build the benchmark: CFLAGS="-O3 -DBENCH" make -B qs
+// Then run "./qs [count]", default one million. Each input is sorted with
+// qsort(3), the original qs() which always pivoted on the first element, and
+// qs(). The original is only run on sorted and reversed input up to 20000
+// elements, since it's quadratic there and recurses once per element.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64
+static unsigned long long rnd(void)
+{
+    static unsigned long long x = 88172645463325252ULL;
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    return x;
+}
+
+static int compare(const void *a, const void *b)
+{
+    return (*(int *)a > *(int *)b) - (*(int *)a < *(int *)b);
+}
+
+// The original qs()
+static void old_qs(int *first, int *last)
 {
     if (first < last)
     {
@@ -14,15 +164,66 @@ static void qs(int *first, int *last)
             while (*f < *first) f++;
             while (*l > *first) l--;
             if (f >= l) break;
-            // swap *f and *l
             *l^=*f; *f^=*l; *l--^=*f++;
         }
-        qs(first, l);
-        qs(l+1, last);
+        old_qs(first, l);
+        old_qs(l+1, last);
     }
 }
 
-#if 1
+int main(int argc, char *argv[])
+{
+    int count = (argc > 1) ? atoi(argv[1]) : 1000000;
+    int *input = malloc(count * sizeof(int)), *expect = malloc(count * sizeof(int)), *v = malloc(count * sizeof(int));
+    char *name[] = {"random", "sorted", "reversed", "dups"};
+
+    if (!input || !expect || !v) abort();
+    printf("%d ints, mS\n", count);
+    printf("%-9s %9s %9s %9s\n", "", "qsort", "old qs", "qs");
+    for (int pattern = 0; pattern < 4; pattern++)
+    {
+        double start, t[3];
+        for (int i = 0; i < count; i++)
+            switch (pattern)
+            {
+                case 0: input[i] = rnd(); break;
+                case 1: input[i] = i; break;
+                case 2: input[i] = count - i; break;
+                default: input[i] = rnd() % 16; break;
+            }
+
+        memcpy(expect, input, count * sizeof(int));
+        start = now();
+        qsort(expect, count, sizeof(int), compare);
+        t[0] = now() - start;
+
+        t[1] = -1;
+        if (count <= 20000 || (pattern != 1 && pattern != 2))
+        {
+            memcpy(v, input, count * sizeof(int));
+            start = now();
+            old_qs(v, v + count - 1);
+            t[1] = now() - start;
+            if (memcmp(v, expect, count * sizeof(int))) abort();
+        }
+
+        memcpy(v, input, count * sizeof(int));
+        start = now();
+        qs(v, v + count - 1);
+        t[2] = now() - start;
+        if (memcmp(v, expect, count * sizeof(int))) abort();
+
+        printf("%-9s %9.2f ", name[pattern], t[0] * 1e3);
+        if (t[1] < 0) printf("%9s ", "-"); else printf("%9.2f ", t[1] * 1e3);
+        printf("%9.2f\n", t[2] * 1e3);
+    }
+    free(input);
+    free(expect);
+    free(v);
+    return 0;
+}
+
+#elif !defined(NOMAIN)
 // POC, accept integers on command line and print sorted list, e.g.:
 //   ./qs $(hexdump -n20000 -e '1/2 "%d\n"' /dev/urandom)
 #include <stdio.h>
@@ -0,0 +1,609 @@
+// Compressed bitmap with the same operations as bitarray.c, for bitmaps which
+// are mostly very sparse or mostly long runs. The bits are split into chunks
+// of 65536 and each chunk with any bit set is kept in a container of one of
+// three types:
+//   ARRAY   sorted 16-bit offsets of the set bits, at most 4096 of them
+//   BITMAP  all 65536 bits in 8K
+//   RUNS    sorted runs of set bits, at most 2048 of them
+// This is the layout of Roaring bitmaps. Containers are kept in key order in
+// one array and found by binary search.
+//
+// roaring_set() and roaring_clear() switch a container to BITMAP when the
+// other types grow too large, and back to ARRAY when it is mostly clear.
+// roaring_optimize() converts every container to its smallest type, in
+// particular to RUNS, so call it after building a bitmap with long runs.
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#define CHUNK 65536                     // bits per container
+#define ARRAYMAX 4096                   // most offsets in an ARRAY container
+#define RUNMAX 2048                     // most runs in a RUNS container
+
+enum {ARRAY, BITMAP, RUNS};
+
+struct run
+{
+    uint16_t start, last;               // first and last offset of the run
+};
+
+struct container
+{
+    uint64_t key;                       // bit number / CHUNK
+    uint32_t count;                     // bits set
+    uint32_t size;                      // offsets or runs in use
+    uint32_t alloc;                     // offsets or runs allocated
+    int type;
+    union
+    {
+        uint16_t *array;
+        uint64_t *bitmap;
+        struct run *runs;
+        void *data;
+    };
+};
+
+typedef struct
+{
+    uint64_t bits;                      // number of represented bits
+    uint64_t set;                       // count of set bits
+    uint64_t size, alloc;               // containers in use and allocated
+    struct container *c;                // sorted by key
+} roaring;
+
+// Return the first offset in bitmap at or after v whose bit equals set, or
+// CHUNK if none
+static uint32_t roaring_scan(uint64_t *bitmap, uint32_t v, bool set)
+{
+    uint64_t flip = set ? 0 : ~0ULL, x;
+    uint32_t w = v / 64;
+
+    if (v >= CHUNK) return CHUNK;
+    x = (bitmap[w] ^ flip) & (~0ULL << v % 64);
+    while (!x)
+    {
+        if (++w == CHUNK / 64) return CHUNK;
+        x = bitmap[w] ^ flip;
+    }
+    return w * 64 + __builtin_ctzll(x);
+}
+
+// Return the number of runs in bitmap
+static uint32_t roaring_runs(uint64_t *bitmap)
+{
+    uint32_t runs = 0;
+    uint64_t carry = 0;
+    for (int w = 0; w < CHUNK / 64; w++)
+    {
+        runs += __builtin_popcountll(bitmap[w] & ~(bitmap[w] << 1 | carry)); // count first bit of each run
+        carry = bitmap[w] >> 63;
+    }
+    return runs;
+}
+
+// Return index of the first offset in array which is >= v
+static uint32_t roaring_lower(uint16_t *array, uint32_t size, uint32_t v)
+{
+    uint32_t lo = 0, hi = size;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (array[mid] < v) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+// Return index of the last run starting at or before v, or -1 if none
+static int roaring_run(struct run *runs, uint32_t size, uint32_t v)
+{
+    int lo = 0, hi = size;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (runs[mid].start <= v) lo = mid + 1; else hi = mid;
+    }
+    return lo - 1;
+}
+
+// Make room for one more offset or run of specified width in c, but don't
+// allocate more than max
+static void roaring_grow(struct container *c, size_t width, uint32_t max)
+{
+    if (c->size < c->alloc) return;
+    c->alloc = (c->alloc * 2 + 4 < max) ? c->alloc * 2 + 4 : max;
+    if (!(c->data = realloc(c->data, c->alloc * width))) abort();
+}
+
+// Convert container to the specified type, by way of a BITMAP
+static void roaring_convert(struct container *c, int type)
+{
+    uint64_t *bitmap;
+
+    if (c->type == type) return;
+    if (c->type == BITMAP) bitmap = c->bitmap;
+    else
+    {
+        if (!(bitmap = calloc(CHUNK / 64, sizeof(uint64_t)))) abort();
+        if (c->type == ARRAY)
+            for (uint32_t i = 0; i < c->size; i++) bitmap[c->array[i] / 64] |= 1ULL << c->array[i] % 64;
+        else
+            for (uint32_t i = 0; i < c->size; i++)
+                for (uint32_t v = c->runs[i].start; v <= c->runs[i].last; v++) bitmap[v / 64] |= 1ULL << v % 64;
+        free(c->data);
+    }
+
+    c->type = type;
+    c->size = 0;
+    if (type == BITMAP)
+    {
+        c->bitmap = bitmap;
+        c->alloc = 0;
+        return;
+    }
+
+    c->alloc = (type == ARRAY) ? c->count : roaring_runs(bitmap);
+    if (!(c->data = malloc(c->alloc * ((type == ARRAY) ? sizeof(uint16_t) : sizeof(struct run)))) && c->alloc) abort();
+    if (type == ARRAY)
+    {
+        for (uint32_t w = 0; w < CHUNK / 64; w++)
+            for (uint64_t x = bitmap[w]; x; x &= x - 1) c->array[c->size++] = w * 64 + __builtin_ctzll(x);
+    }
+    else
+    {
+        for (uint32_t v = roaring_scan(bitmap, 0, true); v < CHUNK; v = roaring_scan(bitmap, v, true))
+        {
+            uint32_t end = roaring_scan(bitmap, v, false);
+            c->runs[c->size++] = (struct run){v, end - 1};
+            v = end;
+        }
+    }
+    free(bitmap);
+}
+
+// Convert non-empty container to whichever type uses the least memory
+static void roaring_shrink(struct container *c)
+{
+    uint32_t runs = 0, array, run;
+
+    if (c->type == RUNS) runs = c->size;
+    else if (c->type == BITMAP) runs = roaring_runs(c->bitmap);
+    else for (uint32_t i = 0; i < c->size; i++) runs += !i || c->array[i] != c->array[i-1] + 1;
+
+    // sizes in bytes, a BITMAP is always CHUNK/8
+    array = (c->count <= ARRAYMAX) ? c->count * sizeof(uint16_t) : UINT32_MAX;
+    run = (runs <= RUNMAX) ? runs * sizeof(struct run) : UINT32_MAX;
+    roaring_convert(c, (run < array && run < CHUNK / 8) ? RUNS : (array <= CHUNK / 8) ? ARRAY : BITMAP);
+
+    if (c->type != BITMAP && c->alloc > c->size)
+    {
+        c->alloc = c->size;
+        if (!(c->data = realloc(c->data, c->alloc * ((c->type == ARRAY) ? sizeof(uint16_t) : sizeof(struct run))))) abort();
+    }
+}
+
+// Return true if offset v is set in c
+static bool roaring_ctest(struct container *c, uint32_t v)
+{
+    uint32_t i;
+    switch (c->type)
+    {
+        case ARRAY: return (i = roaring_lower(c->array, c->size, v)) < c->size && c->array[i] == v;
+        case BITMAP: return c->bitmap[v / 64] & 1ULL << v % 64;
+        default: return (i = roaring_run(c->runs, c->size, v)) != -1 && v <= c->runs[i].last;
+    }
+}
+
+// Set offset v in c, return true if it was clear
+static bool roaring_cset(struct container *c, uint32_t v)
+{
+    switch (c->type)
+    {
+        case ARRAY:
+        {
+            uint32_t i = roaring_lower(c->array, c->size, v);
+            if (i < c->size && c->array[i] == v) return false;
+            if (c->size == ARRAYMAX)
+            {
+                roaring_convert(c, BITMAP);
+                return roaring_cset(c, v);
+            }
+            roaring_grow(c, sizeof(uint16_t), ARRAYMAX);
+            memmove(&c->array[i+1], &c->array[i], (c->size++ - i) * sizeof(uint16_t));
+            c->array[i] = v;
+            break;
+        }
+
+        case BITMAP:
+            if (c->bitmap[v / 64] & 1ULL << v % 64) return false;
+            c->bitmap[v / 64] |= 1ULL << v % 64;
+            break;
+
+        default:
+        {
+            int i = roaring_run(c->runs, c->size, v);
+            if (i >= 0 && v <= c->runs[i].last) return false;
+            bool left = i >= 0 && c->runs[i].last + 1 == v, right = i + 1 < (int)c->size && c->runs[i+1].start == v + 1;
+            if (left && right)
+            {
+                // join two runs
+                c->runs[i].last = c->runs[i+1].last;
+                memmove(&c->runs[i+1], &c->runs[i+2], (--c->size - i - 1) * sizeof(struct run));
+            }
+            else if (left) c->runs[i].last = v;
+            else if (right) c->runs[i+1].start = v;
+            else
+            {
+                roaring_grow(c, sizeof(struct run), RUNMAX + 1);
+                memmove(&c->runs[i+2], &c->runs[i+1], (c->size++ - i - 1) * sizeof(struct run));
+                c->runs[i+1] = (struct run){v, v};
+            }
+            break;
+        }
+    }
+    c->count++;
+    if (c->type == RUNS && c->size > RUNMAX) roaring_convert(c, BITMAP);
+    return true;
+}
+
+// Clear offset v in c, return true if it was set
+static bool roaring_cclear(struct container *c, uint32_t v)
+{
+    switch (c->type)
+    {
+        case ARRAY:
+        {
+            uint32_t i = roaring_lower(c->array, c->size, v);
+            if (i == c->size || c->array[i] != v) return false;
+            memmove(&c->array[i], &c->array[i+1], (--c->size - i) * sizeof(uint16_t));
+            break;
+        }
+
+        case BITMAP:
+            if (!(c->bitmap[v / 64] & 1ULL << v % 64)) return false;
+            c->bitmap[v / 64] &= ~(1ULL << v % 64);
+            break;
+
+        default:
+        {
+            int i = roaring_run(c->runs, c->size, v);
+            if (i < 0 || v > c->runs[i].last) return false;
+            if (c->runs[i].start == c->runs[i].last)
+                memmove(&c->runs[i], &c->runs[i+1], (--c->size - i) * sizeof(struct run));
+            else if (v == c->runs[i].start) c->runs[i].start++;
+            else if (v == c->runs[i].last) c->runs[i].last--;
+            else
+            {
+                // split the run
+                roaring_grow(c, sizeof(struct run), RUNMAX + 1);
+                memmove(&c->runs[i+2], &c->runs[i+1], (c->size++ - i - 1) * sizeof(struct run));
+                c->runs[i+1] = (struct run){v + 1, c->runs[i].last};
+                c->runs[i].last = v - 1;
+            }
+            break;
+        }
+    }
+    c->count--;
+    // Leave BITMAP at half of ARRAYMAX, so a container near the limit doesn't
+    // keep converting back and forth
+    if (c->type == BITMAP && c->count && c->count <= ARRAYMAX / 2) roaring_convert(c, ARRAY);
+    if (c->type == RUNS && c->size > RUNMAX) roaring_convert(c, BITMAP);
+    return true;
+}
+
+// Return the first set offset in c at or after v, or -1 if none
+static int32_t roaring_cnext(struct container *c, uint32_t v)
+{
+    uint32_t i;
+    int r;
+    switch (c->type)
+    {
+        case ARRAY: return ((i = roaring_lower(c->array, c->size, v)) < c->size) ? c->array[i] : -1;
+        case BITMAP: return ((i = roaring_scan(c->bitmap, v, true)) < CHUNK) ? (int32_t)i : -1;
+        default:
+            if ((r = roaring_run(c->runs, c->size, v)) >= 0 && v <= c->runs[r].last) return v;
+            return (r + 1 < (int)c->size) ? c->runs[r+1].start : -1;
+    }
+}
+
+// Return index of the first container with key >= the specified key
+static uint64_t roaring_find(roaring *r, uint64_t key)
+{
+    uint64_t lo = 0, hi = r->size;
+    while (lo < hi)
+    {
+        uint64_t mid = (lo + hi) / 2;
+        if (r->c[mid].key < key) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+// Return the container for key, or NULL if none. If create then a missing
+// container is added as an empty ARRAY.
+static struct container *roaring_get(roaring *r, uint64_t key, bool create)
+{
+    uint64_t i = roaring_find(r, key);
+
+    if (i < r->size && r->c[i].key == key) return &r->c[i];
+    if (!create) return NULL;
+    if (r->size == r->alloc && !(r->c = realloc(r->c, (r->alloc = r->alloc * 2 + 16) * sizeof(struct container)))) abort();
+    memmove(&r->c[i+1], &r->c[i], (r->size++ - i) * sizeof(struct container));
+    r->c[i] = (struct container){.key = key, .type = ARRAY};
+    return &r->c[i];
+}
+
+// Remove container c, which must be empty
+static void roaring_remove(roaring *r, struct container *c)
+{
+    free(c->data);
+    memmove(c, c + 1, (--r->size - (c - r->c)) * sizeof(struct container));
+}
+
+// return 1 if numbered bit is set, 0 if clear, -1 if bit number is invalid
+int roaring_test(roaring *r, uint64_t bit)
+{
+    struct container *c;
+    if (bit >= r->bits) return -1;
+    return (c = roaring_get(r, bit / CHUNK, false)) && roaring_ctest(c, bit % CHUNK);
+}
+
+// Set numbered bit and return 0, or -1 if bit number is invalid
+// Track the number of bits set
+int roaring_set(roaring *r, uint64_t bit)
+{
+    if (bit >= r->bits) return -1;
+    if (roaring_cset(roaring_get(r, bit / CHUNK, true), bit % CHUNK)) r->set++;
+    return 0;
+}
+
+// Reset numbered bit and return 0, or -1 if bit number is invalid
+// Track the number of bits set
+int roaring_clear(roaring *r, uint64_t bit)
+{
+    struct container *c;
+    if (bit >= r->bits) return -1;
+    if ((c = roaring_get(r, bit / CHUNK, false)) && roaring_cclear(c, bit % CHUNK))
+    {
+        r->set--;
+        if (!c->count) roaring_remove(r, c);
+    }
+    return 0;
+}
+
+// Given a bit number, return that number if the bit is set, otherwise return
+// the next highest set bit, or -1 if none.
+int64_t roaring_next(roaring *r, uint64_t bit)
+{
+    if (bit >= r->bits) return -1;
+    for (uint64_t i = roaring_find(r, bit / CHUNK); i < r->size; i++)
+    {
+        int32_t v = roaring_cnext(&r->c[i], (r->c[i].key == bit / CHUNK) ? bit % CHUNK : 0);
+        if (v >= 0) return r->c[i].key * CHUNK + v;
+    }
+    return -1;
+}
+
+// Invert the bitmap. Chunks which were empty become a single run.
+void roaring_invert(roaring *r)
+{
+    uint64_t chunks = (r->bits + CHUNK - 1) / CHUNK, i = 0, n = 0;
+    struct container *c = malloc(chunks * sizeof(struct container));
+
+    if (!c && chunks) abort();
+    for (uint64_t key = 0; key < chunks; key++)
+    {
+        uint32_t limit = (key == chunks - 1 && r->bits % CHUNK) ? r->bits % CHUNK : CHUNK; // valid bits
+        if (i < r->size && r->c[i].key == key)
+        {
+            struct container *o = &r->c[i++];
+            if (o->count == limit)
+            {
+                free(o->data);          // becomes empty
+                continue;
+            }
+            roaring_convert(o, BITMAP);
+            for (int w = 0; w < CHUNK / 64; w++) o->bitmap[w] = ~o->bitmap[w];
+            if (limit < CHUNK)
+            {
+                o->bitmap[limit / 64] &= (1ULL << limit % 64) - 1;
+                memset(&o->bitmap[limit / 64 + 1], 0, (CHUNK / 64 - limit / 64 - 1) * sizeof(uint64_t));
+            }
+            o->count = limit - o->count;
+            roaring_shrink(o);
+            c[n++] = *o;
+        }
+        else
+        {
+            c[n] = (struct container){.key = key, .count = limit, .size = 1, .alloc = 1, .type = RUNS};
+            if (!(c[n].runs = malloc(sizeof(struct run)))) abort();
+            c[n++].runs[0] = (struct run){0, limit - 1};
+        }
+    }
+    free(r->c);
+    r->c = c;
+    r->size = n;
+    r->alloc = chunks;
+    r->set = r->bits - r->set;
+}
+
+// Convert each container to whichever type uses the least memory
+void roaring_optimize(roaring *r)
+{
+    for (uint64_t i = 0; i < r->size; i++) roaring_shrink(&r->c[i]);
+}
+
+// Return the number of bytes allocated for the bitmap
+size_t roaring_memory(roaring *r)
+{
+    size_t size = sizeof(roaring) + r->alloc * sizeof(struct container);
+    for (uint64_t i = 0; i < r->size; i++)
+        switch (r->c[i].type)
+        {
+            case ARRAY: size += r->c[i].alloc * sizeof(uint16_t); break;
+            case BITMAP: size += CHUNK / 8; break;
+            default: size += r->c[i].alloc * sizeof(struct run); break;
+        }
+    return size;
+}
+
+// Create new bitmap and return pointer, or NULL if OOM.
+// Caller must roaring_destroy() it when done.
+roaring *roaring_create(uint64_t bits)
+{
+    roaring *r = calloc(1, sizeof(roaring));
+    if (r) r->bits = bits;
+    return r;
+}
+
+// Free the bitmap
+void roaring_destroy(roaring *r)
+{
+    for (uint64_t i = 0; i < r->size; i++) free(r->c[i].data);
+    free(r->c);
+    free(r);
+}
+
+// Define NOMAIN to #include this file into another program.
+#if defined(POC) && !defined(NOMAIN)  // Compiled with 'CFLAGS=-DPOC make roaring'
+// Perform random operations, mostly in runs, and check against bitarray.c
+#define NOMAIN
+#include "bitarray.c"
+#include <stdio.h>
+#include <assert.h>
+
+int main(void)
+{
+    uint64_t bits = 5 * CHUNK + 1234;
+    roaring *r = roaring_create(bits);
+    bitarray *b = bitarray_create(bits);
+
+    assert(roaring_set(r, bits) == -1);
+    assert(roaring_test(r, bits) == -1);
+    assert(roaring_next(r, 0) == -1);
+
+    srand(1);
+    for (int i = 0; i < 50000; i++)
+    {
+        uint64_t bit = rand() % bits;
+        int op = rand() % 1000, length = 1 + rand() % ((rand() & 1) ? 10 : 5000);
+        if (op < 1) roaring_invert(r), bitarray_invert(b);
+        else if (op < 3) roaring_optimize(r);
+        else
+            for (uint64_t n = bit; n < bit + length && n < bits; n++)
+            {
+                if (op < 500) roaring_set(r, n), bitarray_set(b, n);
+                else roaring_clear(r, n), bitarray_clear(b, n);
+            }
+        assert(r->set == b->set);
+        assert(roaring_test(r, bit) == bitarray_test(b, bit));
+        assert(roaring_next(r, bit) == bitarray_next(b, bit));
+        if (!(i % 5000))
+            for (int64_t n = roaring_next(r, 0), m = bitarray_next(b, 0); ; n = roaring_next(r, n + 1), m = bitarray_next(b, m + 1))
+            {
+                assert(n == m);
+                if (n < 0) break;
+            }
+    }
+    roaring_destroy(r);
+    bitarray_destroy(b);
+    printf("Seems to be working...\n");
+}
+
+#elif defined(BENCH) && !defined(NOMAIN)
+// To build the benchmark: CFLAGS="-O3 -march=native -DBENCH" make -B roaring
+// Then run "./roaring [bits]", default 2^28. For each pattern of set bits, the
+// same bits are set in a dense bitarray.c array and a roaring bitmap (which is
+// then optimized), and it reports the memory used, the ns per bit set, the ns
+// per random bitarray_test() and the ns per set bit to scan with next.
+#define NOMAIN
+#include "bitarray.c"
+#include <stdio.h>
+#include <time.h>
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64, reset seed to repeat a pattern
+static unsigned long long seed;
+static unsigned long long rnd(void)
+{
+    seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+    return seed;
+}
+
+static int dense_set(void *b, uint64_t bit) { return bitarray_set(b, bit); }
+static int roaring_set_(void *r, uint64_t bit) { return roaring_set(r, bit); }
+
+// Call set for each bit of the numbered pattern
+static void fill(int pattern, uint64_t bits, void *b, int (*set)(void *, uint64_t))
+{
+    seed = 88172645463325252ULL;
+    switch (pattern)
+    {
+        case 0:                         // 0.01% random
+        case 1:                         // 1% random
+            for (uint64_t n = bits / (pattern ? 100 : 10000); n; n--) set(b, rnd() % bits);
+            break;
+
+        case 2:                         // runs and gaps of 1 to 2000 bits
+            for (uint64_t bit = rnd() % 2000; bit < bits; bit += 1 + rnd() % 2000)
+                for (uint64_t end = bit + 1 + rnd() % 2000; bit < end && bit < bits; bit++) set(b, bit);
+            break;
+
+        default:                        // 50% random
+            for (uint64_t bit = 0, x = 0; bit < bits; bit++)
+            {
+                if (!(bit % 64)) x = rnd();
+                if (x >> bit % 64 & 1) set(b, bit);
+            }
+            break;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t bits = (argc > 1) ? strtoull(argv[1], NULL, 0) : 1ULL << 28;
+    char *name[] = {"0.01%", "1%", "runs", "50%"};
+
+    printf("%llu bits\n", (unsigned long long)bits);
+    printf("%-6s %-8s %10s %8s %8s %8s\n", "", "", "MB", "set ns", "test ns", "next ns");
+    for (int pattern = 0; pattern < 4; pattern++)
+    {
+        bitarray *b = bitarray_create(bits);
+        roaring *r = roaring_create(bits);
+        double start, t[6];
+        uint64_t hits[2] = {0}, found[2] = {0};
+        if (!b || !r) abort();
+
+        start = now();
+        fill(pattern, bits, b, dense_set);
+        t[0] = now();
+        for (int i = 0; i < 1000000; i++) hits[0] += bitarray_test(b, rnd() % bits);
+        t[1] = now();
+        for (int64_t bit = bitarray_next(b, 0); bit >= 0; bit = bitarray_next(b, bit + 1)) found[0]++;
+        t[2] = now();
+        fill(pattern, bits, r, roaring_set_);
+        roaring_optimize(r);
+        t[3] = now();
+        for (int i = 0; i < 1000000; i++) hits[1] += roaring_test(r, rnd() % bits);
+        t[4] = now();
+        for (int64_t bit = roaring_next(r, 0); bit >= 0; bit = roaring_next(r, bit + 1)) found[1]++;
+        t[5] = now();
+        if (b->set != r->set || found[0] != b->set || found[1] != r->set || hits[0] != hits[1]) abort();
+
+        printf("%-6s %-8s %10.2f %8.2f %8.2f %8.2f\n", name[pattern], "dense",
+               BWORDS(bits) * sizeof(BTYPE) / 1e6, (t[0] - start) * 1e9 / b->set,
+               (t[1] - t[0]) * 1e3, (t[2] - t[1]) * 1e9 / b->set);
+        printf("%-6s %-8s %10.2f %8.2f %8.2f %8.2f\n", "", "roaring",
+               roaring_memory(r) / 1e6, (t[3] - t[2]) * 1e9 / r->set,
+               (t[4] - t[3]) * 1e3, (t[5] - t[4]) * 1e9 / r->set);
+        bitarray_destroy(b);
+        roaring_destroy(r);
+    }
+    return 0;
+}
+#endif
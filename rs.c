@@ -0,0 +1,207 @@
+// LSD radix sort for integer keys, O(n) but needs a temporary copy of the
+// array. Keys are sorted RADIX_BITS at a time starting from the least
+// significant digit, each pass is a stable counting sort. The counts for all
+// digits are collected in one pre-pass, and passes where every key has the
+// same digit are skipped, so e.g. small positive 64-bit keys only take as
+// many passes as their significant bits need. Signed keys are handled by
+// flipping the sign bit. Use qs.c for small arrays, see the benchmark for the
+// crossover.
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifndef RADIX_BITS
+#define RADIX_BITS 11           // 8 is better if the counts don't fit in L1
+#endif
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_MASK (RADIX_SIZE - 1)
+
+// Define function "void name(type *a, size_t n)" to sort n elements of the
+// specified type in place, by integer KEY which is an expression of element
+// x. Elements with equal keys keep their order, so records can be sorted by
+// key with their payload, for example:
+//   RSORT(sort_longs, long, x)
+//   RSORT(sort_pairs, struct pair, x.key)
+#define RSORT(name, type, KEY)                                                  \
+/* return key of x as unsigned, with the sign bit flipped if it's signed */     \
+static inline uint64_t name##_key(type x)                                       \
+{                                                                               \
+    uint64_t k = (uint64_t)(KEY) & (~0ULL >> (64 - 8 * sizeof(KEY)));           \
+    if ((typeof(KEY))-1 < 0) k ^= 1ULL << (8 * sizeof(KEY) - 1);                \
+    return k;                                                                   \
+}                                                                               \
+                                                                                \
+static void name(type *a, size_t n)                                             \
+{                                                                               \
+    type x;                     /* for sizeof(KEY) */                           \
+    type *from = a;                                                             \
+    type *to = malloc(n * sizeof(type));                                        \
+    int digits = (8 * sizeof(KEY) + RADIX_BITS - 1) / RADIX_BITS;               \
+    size_t (*count)[RADIX_SIZE] = calloc(digits, sizeof(*count));               \
+                                                                                \
+    if (n < 2) goto out;                                                        \
+    if (!to || !count) abort();                                                 \
+    for (size_t i = 0; i < n; i++)                                              \
+    {                                                                           \
+        uint64_t k = name##_key(a[i]);                                          \
+        for (int d = 0; d < digits; d++) count[d][(k >> d * RADIX_BITS) & RADIX_MASK]++; \
+    }                                                                           \
+                                                                                \
+    for (int d = 0; d < digits; d++)                                            \
+    {                                                                           \
+        size_t *c = count[d], sum = 0;                                          \
+        type *t;                                                                \
+        if (c[(name##_key(a[0]) >> d * RADIX_BITS) & RADIX_MASK] == n) continue; \
+        for (int j = 0; j < RADIX_SIZE; j++)                                    \
+        {                                                                       \
+            size_t s = c[j];                                                    \
+            c[j] = sum;                                                         \
+            sum += s;                                                           \
+        }                                                                       \
+        for (size_t i = 0; i < n; i++)                                          \
+            to[c[(name##_key(from[i]) >> d * RADIX_BITS) & RADIX_MASK]++] = from[i]; \
+        t = from; from = to; to = t;                                            \
+    }                                                                           \
+    if (from != a)                                                              \
+    {                                                                           \
+        memcpy(a, from, n * sizeof(type));                                      \
+        to = from;                                                              \
+    }                                                                           \
+  out:                                                                          \
+    free(to);                                                                   \
+    free(count);                                                                \
+}
+
+RSORT(rs, int, x)
+
+// Define NOMAIN to #include this file into another program.
+#if defined(BENCH) && !defined(NOMAIN)
+// To build the benchmark: CFLAGS="-O3 -DBENCH" make -B rs
+// Then run "./rs [max]", default 10 million. For random ints in arrays of 8
+// elements up to max, it reports ns per element for bs(), qs() and rs(), and
+// which is fastest. bs() stops at 512 elements. Then it sorts max 64-bit
+// keys, and max 64-bit keys with a 64-bit payload, with qs() and rs().
+#define NOMAIN
+#include "qs.c"
+#include <stdio.h>
+#include <time.h>
+
+struct pair
+{
+    int64_t key;
+    void *value;
+};
+
+QSORT(qs64, int64_t, x < y)
+RSORT(rs64, int64_t, x)
+QSORT(qs_pairs, struct pair, x.key < y.key)
+RSORT(rs_pairs, struct pair, x.key)
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64
+static unsigned long long rnd(void)
+{
+    static unsigned long long x = 88172645463325252ULL;
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    return x;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t max = (argc > 1) ? strtoull(argv[1], NULL, 0) : 10000000;
+    int *input = malloc(max * sizeof(int)), *v = malloc(max * sizeof(int)), *expect = malloc(max * sizeof(int));
+
+    if (!input || !v || !expect) abort();
+    for (size_t i = 0; i < max; i++) input[i] = rnd();
+
+    printf("%10s %8s %8s %8s  ns per element\n", "ints", "bs", "qs", "rs");
+    for (size_t n = 8; n <= max; n *= 4)
+    {
+        size_t repeat = (max / n) ? max / n : 1;
+        double t[3];
+        for (int i = 0; i < 3; i++)
+        {
+            int sort = (int []){1, 0, 2}[i]; // qs first, to check the others
+            double start;
+            if (!sort && n > 512)
+            {
+                t[sort] = 1e99;
+                continue;
+            }
+            start = now();
+            for (size_t r = 0; r < repeat; r++)
+            {
+                memcpy(v, input + (r * n) % (max - n + 1), n * sizeof(int));
+                switch (sort)
+                {
+                    case 0: bs(v, n); break;
+                    case 1: qs(v, v + n - 1); break;
+                    default: rs(v, n); break;
+                }
+            }
+            t[sort] = (now() - start) * 1e9 / (repeat * n);
+            if (sort == 1) memcpy(expect, v, n * sizeof(int));
+            else if (memcmp(expect, v, n * sizeof(int))) abort();
+        }
+        printf("%10zu ", n);
+        if (n > 512) printf("%8s ", "-"); else printf("%8.2f ", t[0]);
+        printf("%8.2f %8.2f  %s\n", t[1], t[2], (t[0] < t[1] && t[0] < t[2]) ? "bs" : (t[1] < t[2]) ? "qs" : "rs");
+    }
+    free(v);
+    free(expect);
+
+    int64_t *k = malloc(max * sizeof(int64_t)), *k2 = malloc(max * sizeof(int64_t));
+    struct pair *p = malloc(max * sizeof(struct pair)), *p2 = malloc(max * sizeof(struct pair));
+    double start, t[4];
+    if (!k || !k2 || !p || !p2) abort();
+    for (size_t i = 0; i < max; i++)
+    {
+        k[i] = k2[i] = rnd();
+        p[i] = p2[i] = (struct pair){rnd() % 1000000 - 500000, (void *)i};
+    }
+    start = now();
+    qs64(k, max);
+    t[0] = now();
+    rs64(k2, max);
+    t[1] = now();
+    qs_pairs(p, max);
+    t[2] = now();
+    rs_pairs(p2, max);
+    t[3] = now();
+    if (memcmp(k, k2, max * sizeof(int64_t))) abort();
+    for (size_t i = 0; i < max; i++)
+    {
+        if (p[i].key != p2[i].key) abort();
+        if (i && p2[i].key == p2[i-1].key && p2[i].value < p2[i-1].value) abort(); // stable
+    }
+    printf("\n%10s %8s %8s  mS for %zu\n", "", "qs", "rs", max);
+    printf("%10s %8.1f %8.1f\n", "int64", (t[0] - start) * 1e3, (t[1] - t[0]) * 1e3);
+    printf("%10s %8.1f %8.1f\n", "int64+ptr", (t[2] - t[1]) * 1e3, (t[3] - t[2]) * 1e3);
+    free(input);
+    free(k);
+    free(k2);
+    free(p);
+    free(p2);
+    return 0;
+}
+
+#elif !defined(NOMAIN)
+// POC, accept integers on command line and print sorted list, e.g.:
+//   ./rs $(od -An -vtd4 -N4000 /dev/urandom)
+#include <stdio.h>
+
+int main(int argc , char *argv[])
+{
+    int vs=argc-1, v[vs], x;
+    for (x=0; x < vs; x++) v[x]=atoi(argv[x+1]);
+    rs(v, vs);
+    for (x=0; x < vs; x++) printf("%d\n",v[x]);
+    return 0;
+}
+#endif
@@ -0,0 +1,338 @@
+// Segmented sieve of Eratosthenes, finds all primes in a range [lo, hi] for
+// any 64-bit lo and hi.
+//
+// Only odd numbers are sieved, one bit each, in segments of SEGMENT bytes so
+// the bits being cleared stay in cache. Threads take segments in turn from a
+// counter and sieve them into a small ring of buffers, from which the primes in
+// each segment are passed to the caller in order.
+//
+// Sieving needs the odd primes up to sqrt(hi). These are found the same way,
+// and stored as half the gap to the next one, which fits in a byte for primes
+// below 2^32. That's about 200MB for hi near 2^64, where each segment also has
+// to find the first multiple of each of those ~200 million primes, so it's
+// slow for a narrow range up there. For single numbers use prime.c.
+//
+// Link with -pthread -lm.
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#define SEGMENT (1 << 17)       // bytes per segment, should fit in L2 cache
+#define MAXTHREADS 256          // each needs two segments
+
+// Odd primes from 3 up to some limit, each is the previous plus 2*gap[n-1]
+struct primes
+{
+    uint64_t count;
+    uint64_t last;              // the last prime
+    size_t size;                // allocated gaps
+    unsigned char *gap;
+};
+
+struct sieve_job
+{
+    uint64_t first, last;       // odd first to last, inclusive
+    uint64_t *bits;             // set if first+2*bit is prime
+    uint64_t count;             // primes in segment
+    uint64_t done;              // segment number + 1 once sieved
+};
+
+// State shared by the threads of sieve_odd()
+struct sieve_run
+{
+    struct primes *base;        // primes up to sqrt(hi)
+    uint64_t lo, hi, segments;
+    uint64_t next;              // next segment to claim
+    uint64_t reported;          // segments passed to the caller's fn
+    int slots;                  // segment s is sieved in job[s % slots]
+    struct sieve_job *job;
+    pthread_mutex_t lock;       // and cond, for done and reported
+    pthread_cond_t cond;
+};
+
+// Return the integer square root of n
+static uint64_t isqrt64(uint64_t n)
+{
+    uint64_t r = sqrt((double)n);
+    while (r > 0xffffffff || r * r > n) r--;
+    while (r < 0xffffffff && (r + 1) * (r + 1) <= n) r++;
+    return r;
+}
+
+// Sieve segment s of the run, count the primes
+static void sieve_segment(struct sieve_run *r, uint64_t s)
+{
+    struct sieve_job *j = &r->job[s % r->slots];
+    uint64_t span = SEGMENT * 16ULL, bits, words, p = 3;
+
+    j->first = r->lo + s * span;
+    j->last = (r->hi - j->first < span) ? r->hi : j->first + span - 1;
+    bits = (j->last - j->first) / 2 + 1;
+    words = (bits + 63) / 64;
+
+    memset(j->bits, 0xff, words * 8);
+    if (bits % 64) j->bits[words - 1] = (1ULL << (bits % 64)) - 1;
+
+    for (uint64_t k = 0; k < r->base->count && p * p <= j->last; p += 2 * r->base->gap[k++])
+    {
+        // first odd multiple of p in the segment, starting at p*p since lesser
+        // multiples have a lesser factor
+        uint64_t m = p * p;
+        if (m < j->first)
+        {
+            m = j->first / p * p;
+            if (m < j->first)
+            {
+                if (m > j->last - p) continue;
+                m += p;
+            }
+            if (!(m & 1))
+            {
+                if (m > j->last - p) continue;
+                m += p;
+            }
+        }
+        for (uint64_t i = (m - j->first) / 2; i < bits; i += p) j->bits[i / 64] &= ~(1ULL << (i % 64));
+    }
+
+    j->count = 0;
+    for (uint64_t w = 0; w < words; w++) j->count += __builtin_popcountll(j->bits[w]);
+
+    pthread_mutex_lock(&r->lock);
+    __atomic_store_n(&j->done, s + 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Worker thread, claim segments until there are none left. A segment's slot
+// must wait for the caller to report the segment before it.
+static void *sieve_worker(void *arg)
+{
+    struct sieve_run *r = arg;
+    uint64_t s;
+
+    while ((s = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED)) < r->segments)
+    {
+        pthread_mutex_lock(&r->lock);
+        while (s >= r->reported + r->slots) pthread_cond_wait(&r->cond, &r->lock);
+        pthread_mutex_unlock(&r->lock);
+        sieve_segment(r, s);
+    }
+    return NULL;
+}
+
+// Sieve odd numbers from lo to hi with the base primes, using threads. Call
+// fn(p, arg) for each prime p in order, if fn isn't NULL. Return the number of
+// primes.
+static uint64_t sieve_odd(uint64_t lo, uint64_t hi, struct primes *base, int threads,
+                          void (*fn)(uint64_t p, void *arg), void *arg)
+{
+    struct sieve_run r = { .base = base, .lo = lo, .hi = hi, .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+    pthread_t *tid;
+    uint64_t count = 0;
+
+    if (lo > hi) return 0;
+    r.segments = (hi - lo) / (SEGMENT * 16ULL) + 1;
+    if ((uint64_t)threads > r.segments) threads = r.segments;
+
+    // two slots per thread, so workers can run ahead of the caller reporting
+    r.slots = threads * 2;
+    r.job = calloc(r.slots, sizeof(struct sieve_job));
+    tid = malloc(threads * sizeof(pthread_t));
+    if (!r.job || !tid) abort();
+    for (int t = 0; t < r.slots; t++)
+        if (!(r.job[t].bits = malloc(SEGMENT))) abort();
+    for (int t = 1; t < threads; t++)
+        if (pthread_create(&tid[t], NULL, sieve_worker, &r)) abort();
+
+    // the caller is thread 0, it reports each segment in order when it's done
+    // and otherwise sieves, but only a segment whose slot is already free
+    for (uint64_t s = 0; s < r.segments; s++)
+    {
+        struct sieve_job *j = &r.job[s % r.slots];
+
+        while (__atomic_load_n(&j->done, __ATOMIC_ACQUIRE) != s + 1)
+        {
+            uint64_t n = __atomic_load_n(&r.next, __ATOMIC_RELAXED);
+            if (n < r.segments && n < s + r.slots &&
+                __atomic_compare_exchange_n(&r.next, &n, n + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                sieve_segment(&r, n);
+            else if (n >= r.segments || n >= s + r.slots)
+            {
+                // nothing to claim, wait for a worker
+                pthread_mutex_lock(&r.lock);
+                while (j->done != s + 1) pthread_cond_wait(&r.cond, &r.lock);
+                pthread_mutex_unlock(&r.lock);
+            }
+        }
+
+        count += j->count;
+        if (fn)
+            for (uint64_t w = 0; w <= (j->last - j->first) / 128; w++)
+                for (uint64_t b = j->bits[w]; b; b &= b - 1)
+                    fn(j->first + 2 * (w * 64 + __builtin_ctzll(b)), arg);
+
+        // free the slot
+        pthread_mutex_lock(&r.lock);
+        r.reported = s + 1;
+        pthread_cond_broadcast(&r.cond);
+        pthread_mutex_unlock(&r.lock);
+    }
+
+    for (int t = 1; t < threads; t++) pthread_join(tid[t], NULL);
+    for (int t = 0; t < r.slots; t++) free(r.job[t].bits);
+    free(r.job);
+    free(tid);
+    return count;
+}
+
+// Add prime p to struct primes
+static void sieve_add(uint64_t p, void *arg)
+{
+    struct primes *primes = arg;
+
+    if (primes->count + 1 > primes->size)
+    {
+        primes->size = primes->size ? primes->size * 2 : 4096;
+        primes->gap = realloc(primes->gap, primes->size);
+        if (!primes->gap) abort();
+    }
+    if (primes->count) primes->gap[primes->count - 1] = (p - primes->last) / 2;
+    primes->gap[primes->count++] = 0;
+    primes->last = p;
+}
+
+// Return the odd primes up to max, which must be less than 2^32
+static struct primes *sieve_base(uint64_t max, int threads)
+{
+    struct primes *primes = calloc(1, sizeof(struct primes)), *base;
+
+    if (!primes) abort();
+    if (max < 3) return primes;
+    base = sieve_base(isqrt64(max), threads);
+    sieve_odd(3, max, base, threads, sieve_add, primes);
+    free(base->gap);
+    free(base);
+    return primes;
+}
+
+// Call fn(p, arg) for each prime p from lo to hi inclusive in ascending order,
+// using the specified number of threads, at most MAXTHREADS. fn may be NULL to just count them.
+// Return the number of primes.
+uint64_t sieve(uint64_t lo, uint64_t hi, int threads, void (*fn)(uint64_t p, void *arg), void *arg)
+{
+    struct primes *base;
+    uint64_t count = 0;
+
+    if (threads < 1) threads = 1;
+    if (threads > MAXTHREADS) threads = MAXTHREADS;
+    if (lo <= 2 && hi >= 2)
+    {
+        if (fn) fn(2, arg);
+        count++;
+    }
+    lo = (lo < 3) ? 3 : lo | 1;
+    if (lo > hi) return count;
+
+    base = sieve_base(isqrt64(hi), threads);
+    count += sieve_odd(lo, hi, base, threads, fn, arg);
+    free(base->gap);
+    free(base);
+    return count;
+}
+
+// Define NOMAIN to #include this file into another program.
+#if defined(BENCH) && !defined(NOMAIN)
+// To build the benchmark: CFLAGS="-O3 -DBENCH" LDLIBS="-pthread -lm" make -B sieve
+// Then run "./sieve [width [threads]]", default 1 million and 4 threads. It
+// counts the primes in ranges of width numbers at various points up to 10^15
+// by testing each number with prime() from prime.c, i.e. trial division by
+// small primes then Miller-Rabin, and with sieve(). Then it counts the primes
+// below 10^6 up to 10^10 with sieve() using 1 and threads threads.
+#define NOMAIN
+#include "prime.c"
+#include <time.h>
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t width = (argc > 1) ? strtoull(argv[1], NULL, 0) : 1000000;
+    int threads = (argc > 2) ? atoi(argv[2]) : 4;
+    uint64_t start[] = {0, 1000000, 1000000000, 4294967296ULL - width, 1000000000000ULL, 1000000000000000ULL};
+
+    printf("%16s %10s %10s %10s  mS for %llu numbers\n", "start", "primes", "prime()", "sieve()", (unsigned long long)width);
+    for (int i = 0; i < 6; i++)
+    {
+        uint64_t count = 0, count2;
+        double t[3];
+        t[0] = now();
+        for (uint64_t n = start[i]; n < start[i] + width; n++) count += n > 1 && isprime(n);
+        t[1] = now();
+        count2 = sieve(start[i], start[i] + width - 1, 1, NULL, NULL);
+        t[2] = now();
+        if (count != count2) abort();
+        printf("%16llu %10llu %10.1f %10.1f\n", (unsigned long long)start[i], (unsigned long long)count,
+               (t[1] - t[0]) * 1e3, (t[2] - t[1]) * 1e3);
+    }
+
+    printf("\n%12s %12s %10s %10s  mS\n", "below", "primes", "1 thread", "threads");
+    for (uint64_t max = 1000000; max <= 10000000000ULL; max *= 10)
+    {
+        uint64_t count, count2;
+        double t[3];
+        t[0] = now();
+        count = sieve(0, max - 1, 1, NULL, NULL);
+        t[1] = now();
+        count2 = sieve(0, max - 1, threads, NULL, NULL);
+        t[2] = now();
+        if (count != count2) abort();
+        printf("%12llu %12llu %10.1f %10.1f\n", (unsigned long long)max, (unsigned long long)count,
+               (t[1] - t[0]) * 1e3, (t[2] - t[1]) * 1e3);
+    }
+    return 0;
+}
+
+#elif !defined(NOMAIN)
+// Print the primes from lo to hi, or just count them:
+//   ./sieve [-c] [-t threads] lo hi
+#include <stdio.h>
+#include <unistd.h>
+
+static void show(uint64_t p, void *arg)
+{
+    (void)arg;
+    printf("%llu\n", (unsigned long long)p);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, counting = 0, threads = 1;
+    uint64_t count;
+
+    while ((opt = getopt(argc, argv, "ct:")) != -1)
+        switch (opt)
+        {
+            case 'c': counting = 1; break;
+            case 't': threads = atoi(optarg); if (threads >= 1 && threads <= MAXTHREADS) break; // else fall through
+            default: goto usage;
+        }
+    if (argc - optind != 2)
+    {
+      usage:
+        fprintf(stderr, "Usage: %s [-c] [-t threads] lo hi\nWhere threads is 1 to %d\n", argv[0], MAXTHREADS);
+        return 1;
+    }
+
+    count = sieve(strtoull(argv[optind], NULL, 0), strtoull(argv[optind + 1], NULL, 0), threads, counting ? NULL : show, NULL);
+    if (counting) printf("%llu\n", (unsigned long long)count);
+    return 0;
+}
+#endif
@@ -0,0 +1,301 @@
+// String keyed map built on bst.c. Each string is hashed to a 64-bit tree key
+// and the tree node's value is the chain of entries with that hash, so
+// colliding strings are kept apart instead of merged. Entries hold a copy of
+// their string, which is only compared after the hash matches.
+//
+// The _hash functions take the string's length and hash from sm_hash(), so a
+// caller can hash a string once and use it for several operations.
+#define NOMAIN
+#include "bst.c"
+#include <string.h>
+#include <stdint.h>
+
+struct entry
+{
+    struct entry *next;         // next entry with the same hash
+    void *value;                // NULL or malloced, owned by the map
+    int counter;
+    size_t length;
+    char key[];                 // NUL terminated copy of the key
+};
+
+struct strmap
+{
+    struct node *root;
+    struct pool pool;
+};
+
+// Return 64-bit hash of string with given length. This reads 8 bytes at a
+// time, each step is one multiply.
+long long sm_hash(const char *key, size_t length)
+{
+    uint64_t h = length * 0x9E3779B97F4A7C15ULL, w;
+
+    for (; length >= 8; key += 8, length -= 8)
+    {
+        memcpy(&w, key, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, key, length);
+    h = (h ^ w) * 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 29;
+    return h;
+}
+
+// Return pointer to the link to the entry for key in the hash chain, the
+// link is NULL if not found. If not NULL, *node is set to the tree node for
+// the hash or NULL.
+static struct entry **sm_find(struct strmap *m, const char *key, size_t length, long long hash, struct node **node)
+{
+    struct node *n = search(m->root, hash);
+    struct entry **link = n ? (struct entry **)&n->value : NULL;
+
+    if (node) *node = n;
+    if (!link) return NULL;
+    while (*link && ((*link)->length != length || memcmp((*link)->key, key, length))) link = &(*link)->next;
+    return link;
+}
+
+// Return entry for key with specified length and hash, or NULL
+struct entry *sm_search_hash(struct strmap *m, const char *key, size_t length, long long hash)
+{
+    struct entry **link = sm_find(m, key, length, hash, NULL);
+    return link ? *link : NULL;
+}
+
+// Insert key and value into map.
+// If key already exists, just replace the value.
+// Note *value must either be NULL or malloced.
+// If counting then increment counter if key exists.
+void sm_insert_hash(struct strmap *m, const char *key, size_t length, long long hash, void *value, bool counting)
+{
+    struct node *n;
+    struct entry **link = sm_find(m, key, length, hash, &n), *e;
+
+    if (link && *link)
+    {
+        e = *link;
+        if (e->value) free(e->value);
+        e->value = value;
+        if (counting) e->counter++;
+        return;
+    }
+
+    e = malloc(sizeof(struct entry) + length + 1);
+    if (!e) abort();
+    e->value = value;
+    e->counter = 1;
+    e->length = length;
+    memcpy(e->key, key, length);
+    e->key[length] = 0;
+
+    if (n)
+    {
+        // hash collision, add to the chain
+        e->next = n->value;
+        n->value = e;
+    }
+    else
+    {
+        e->next = NULL;
+        m->root = insert(&m->pool, m->root, hash, e, false);
+    }
+}
+
+// Delete key from map if it exists. If counting, only delete when entry
+// counter decrements to 0.
+void sm_delete_hash(struct strmap *m, const char *key, size_t length, long long hash, bool counting)
+{
+    struct node *n;
+    struct entry **link = sm_find(m, key, length, hash, &n), *e;
+
+    if (!link || !(e = *link)) return;
+    if (counting && --e->counter) return;
+
+    *link = e->next;
+    if (e->value) free(e->value);
+    free(e);
+    if (!n->value) m->root = delete(&m->pool, m->root, hash, false); // chain is empty
+}
+
+// As above, but hash the NUL terminated key
+struct entry *sm_search(struct strmap *m, const char *key)
+{
+    size_t length = strlen(key);
+    return sm_search_hash(m, key, length, sm_hash(key, length));
+}
+
+void sm_insert(struct strmap *m, const char *key, void *value, bool counting)
+{
+    size_t length = strlen(key);
+    sm_insert_hash(m, key, length, sm_hash(key, length), value, counting);
+}
+
+void sm_delete(struct strmap *m, const char *key, bool counting)
+{
+    size_t length = strlen(key);
+    sm_delete_hash(m, key, length, sm_hash(key, length), counting);
+}
+
+// Free the map, all its entries and their values
+void sm_destroy(struct strmap *m)
+{
+    struct iter it = {0};
+    struct node *n;
+
+    iter_seek(&it, m->root, LLONG_MIN, false);
+    while ((n = iter_next(&it)))
+    {
+        struct entry *e = n->value;
+        while (e)
+        {
+            struct entry *next = e->next;
+            if (e->value) free(e->value);
+            free(e);
+            e = next;
+        }
+        n->value = NULL;
+    }
+    iter_end(&it);
+    destroy(&m->pool, m->root);
+    m->root = NULL;
+}
+
+// To build the proof-of-concept: CFLAGS=-DPOC make -B strmap
+#ifdef POC
+#include <stdio.h>
+#include <assert.h>
+
+int main(void)
+{
+    struct strmap m = {0};
+
+    sm_insert(&m, "cow", strdup("moo"), true);
+    sm_insert(&m, "cow", NULL, true);
+    sm_insert(&m, "cat", strdup("meow"), true);
+    assert(sm_search(&m, "cow")->counter == 2);
+    assert(!sm_search(&m, "cow")->value);
+    assert(!strcmp(sm_search(&m, "cat")->value, "meow"));
+    assert(!sm_search(&m, "dog"));
+
+    // force "ox", "owl" and "pig" to collide
+    sm_insert_hash(&m, "ox", 2, 42, strdup("moo"), true);
+    sm_insert_hash(&m, "owl", 3, 42, strdup("hoot"), true);
+    sm_insert_hash(&m, "pig", 3, 42, strdup("oink"), true);
+    sm_insert_hash(&m, "owl", 3, 42, NULL, true);
+    assert(!strcmp(sm_search_hash(&m, "ox", 2, 42)->value, "moo"));
+    assert(sm_search_hash(&m, "owl", 3, 42)->counter == 2);
+    assert(!sm_search_hash(&m, "owls", 4, 42));
+    sm_delete_hash(&m, "owl", 3, 42, false);
+    assert(!sm_search_hash(&m, "owl", 3, 42));
+    assert(!strcmp(sm_search_hash(&m, "pig", 3, 42)->value, "oink"));
+    sm_delete_hash(&m, "ox", 2, 42, true);
+    sm_delete_hash(&m, "pig", 3, 42, true);
+    assert(!search(m.root, 42));    // empty chain is removed from the tree
+
+    sm_delete(&m, "cow", true);
+    assert(sm_search(&m, "cow")->counter == 1);
+    sm_delete(&m, "cow", true);
+    assert(!sm_search(&m, "cow"));
+
+    sm_destroy(&m);
+    printf("Seems to be working...\n");
+    return 0;
+}
+#endif
+
+// To build the benchmark: CFLAGS="-O2 -DBENCH -DBALANCE" make -B strmap
+// Then run "./strmap [file]" to load words from the file, one per line, or
+// generate a million random mixed case words if no file is given. Words are
+// inserted with counting and then looked up, first keyed only by the old
+// bst.c POC hash, then with strmap.
+#ifdef BENCH
+#include <stdio.h>
+#include <time.h>
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Hash from the bst.c POC
+static long long hash(char *key)
+{
+    long long h = 0;
+    while (*key) h = (h * 33) + *key++;
+    return h;
+}
+
+int main(int argc, char *argv[])
+{
+    char **words = NULL, line[256];
+    int count = 0, size = 0;
+    struct pool pool = {0};
+    struct node *tree = NULL;
+    struct strmap m = {0};
+    double start, t;
+
+    if (argc > 1)
+    {
+        FILE *f = fopen(argv[1], "r");
+        if (!f) return perror(argv[1]), 1;
+        while (fgets(line, sizeof line, f))
+        {
+            line[strcspn(line, "\r\n")] = 0;
+            if (count == size && !(words = realloc(words, (size = size * 2 + 1024) * sizeof(char *)))) abort();
+            words[count++] = strdup(line);
+        }
+        fclose(f);
+    }
+    else
+    {
+        unsigned long long x = 88172645463325252ULL;
+        words = malloc((size = 1000000) * sizeof(char *));
+        if (!words) abort();
+        for (count = 0; count < size; count++)
+        {
+            int length = 3 + count % 10;
+            for (int i = 0; i < length; i++)
+            {
+                x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+                line[i] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"[x % 52];
+            }
+            line[length] = 0;
+            words[count] = strdup(line);
+        }
+    }
+    printf("%d words\n", count);
+
+    start = now();
+    for (int i = 0; i < count; i++) tree = insert(&pool, tree, hash(words[i]), NULL, true);
+    t = now(); printf("hash only insert %6.1f ns/word\n", (t - start) * 1e9 / count); start = t;
+    for (int i = 0; i < count; i++) if (!search(tree, hash(words[i]))) abort();
+    t = now(); printf("hash only search %6.1f ns/word\n", (t - start) * 1e9 / count); start = t;
+
+    for (int i = 0; i < count; i++) sm_insert(&m, words[i], NULL, true);
+    t = now(); printf("strmap insert    %6.1f ns/word\n", (t - start) * 1e9 / count); start = t;
+    for (int i = 0; i < count; i++) if (!sm_search(&m, words[i])) abort();
+    t = now(); printf("strmap search    %6.1f ns/word\n", (t - start) * 1e9 / count);
+
+    // Every distinct word has an entry, the hash only tree merged collisions
+    long long keys = 0, entries = 0;
+    struct iter it = {0};
+    struct node *n;
+    iter_seek(&it, m.root, LLONG_MIN, false);
+    while ((n = iter_next(&it))) for (struct entry *e = n->value; e; e = e->next) entries++;
+    iter_seek(&it, tree, LLONG_MIN, false);
+    while (iter_next(&it)) keys++;
+    iter_end(&it);
+    printf("%lld distinct words, %lld merged by hash only\n", entries, entries - keys);
+
+    sm_destroy(&m);
+    destroy(&pool, tree);
+    for (int i = 0; i < count; i++) free(words[i]);
+    free(words);
+    return 0;
+}
+#endif